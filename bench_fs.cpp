@@ -0,0 +1,211 @@
+#pragma clang diagnostic push
+#pragma ide diagnostic ignored "cert-msc51-cpp"
+#pragma ide diagnostic ignored "cert-msc50-cpp"
+
+// Filesystem benchmarks: drives Filesystem::invoke through a bare lua_State and prints one JSON object per result
+// usage: bench_fs [work_directory] [scale], the project is created in work_directory/bench_fs and removed afterwards
+
+#include <iostream>
+#include <map>
+#include <vector>
+#include <random>
+
+#include "components.cpp"
+#include "computer.cpp"
+
+#include "lua5.3/lua.h"
+#include "lua5.3/lauxlib.h"
+
+using std::string;
+
+static const string BENCH_FILESYSTEM = "bench";
+static const size_t BENCH_CHUNK_SIZES[] = {64, 512, 4096, 65536, 1048576};
+static const size_t BENCH_FILE_SIZE = 16 * 1048576;
+static const int BENCH_RANDOM_OPS = 4096;
+static const int BENCH_SMALL_FILES = 2000;
+static const int BENCH_LIST_ENTRIES = 10000;
+static const int BENCH_LIST_REPEATS = 100;
+static const int BENCH_TREE_DEPTH = 32;
+static const int BENCH_TREE_FILES = 16;
+
+static lua_State *state = nullptr;
+
+static void push(lua_State *L, const char *s) { lua_pushstring(L, s); }
+
+static void push(lua_State *L, const string &s) { lua_pushlstring(L, s.data(), s.size()); }
+
+static void push(lua_State *L, long long n) { lua_pushinteger(L, n); }
+
+// calls a method with a fresh stack, results are left on the stack until the next call
+template<class... Args>
+static int call(Filesystem *fs, const string &method, Args... args) {
+    lua_settop(state, 0);
+    (push(state, args), ...);
+    return fs->invoke(method, state);
+}
+
+template<class... Args>
+static long long call_integer(Filesystem *fs, const string &method, Args... args) {
+    int results = call(fs, method, args...);
+    return results > 0 ? lua_tointeger(state, -results) : -1;
+}
+
+static double now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void report(const string &bench, size_t chunk, long long ops, unsigned long long bytes, double seconds) {
+    std::cout << "{\"bench\": \"" << bench << "\", \"chunk\": " << chunk << ", \"ops\": " << ops
+              << ", \"bytes\": " << bytes << ", \"seconds\": " << seconds
+              << ", \"ops_per_sec\": " << (seconds > 0 ? ops / seconds : 0)
+              << ", \"mb_per_sec\": " << (seconds > 0 ? bytes / seconds / 1048576 : 0) << "}" << std::endl;
+}
+
+static Filesystem *open_filesystem(const string &project_dir) {
+    return new Filesystem(project_dir, BENCH_FILESYSTEM);
+}
+
+static void bench_sequential(Filesystem *fs, size_t file_size) {
+    for (size_t chunk : BENCH_CHUNK_SIZES) {
+        string data(chunk, 'x');
+        long long ops = file_size / chunk;
+        double start = now();
+        long long handle = call_integer(fs, "open", "/sequential", "w");
+        for (long long i = 0; i < ops; i++) call(fs, "write", handle, data);
+        call(fs, "close", handle);
+        report("sequential_write", chunk, ops, ops * chunk, now() - start);
+
+        start = now();
+        handle = call_integer(fs, "open", "/sequential");
+        long long reads = 0;
+        unsigned long long bytes = 0;
+        while (call(fs, "read", handle, (long long) chunk) > 0) {
+            size_t length = 0;
+            lua_tolstring(state, -1, &length);
+            bytes += length;
+            reads++;
+        }
+        call(fs, "close", handle);
+        report("sequential_read", chunk, reads, bytes, now() - start);
+    }
+}
+
+static void bench_random(Filesystem *fs, size_t file_size) {
+    std::mt19937_64 random(42);
+    for (size_t chunk : BENCH_CHUNK_SIZES) {
+        if (chunk > file_size) continue;
+        std::uniform_int_distribution<long long> offsets(0, (long long) (file_size / chunk) - 1);
+        long long ops = std::min<long long>(BENCH_RANDOM_OPS, file_size / chunk);
+        string data(chunk, 'y');
+        double start = now();
+        long long handle = call_integer(fs, "open", "/sequential", "a");
+        for (long long i = 0; i < ops; i++) {
+            call(fs, "seek", handle, "set", offsets(random) * (long long) chunk);
+            call(fs, "write", handle, data);
+        }
+        call(fs, "close", handle);
+        report("random_write", chunk, ops, ops * chunk, now() - start);
+
+        start = now();
+        handle = call_integer(fs, "open", "/sequential");
+        unsigned long long bytes = 0;
+        for (long long i = 0; i < ops; i++) {
+            call(fs, "seek", handle, "set", offsets(random) * (long long) chunk);
+            if (call(fs, "read", handle, (long long) chunk) > 0) {
+                size_t length = 0;
+                lua_tolstring(state, -1, &length);
+                bytes += length;
+            }
+        }
+        call(fs, "close", handle);
+        report("random_read", chunk, ops, bytes, now() - start);
+    }
+    call(fs, "remove", "/sequential");
+}
+
+static void bench_small_files(Filesystem *fs, int count) {
+    string data(100, 'z');
+    call(fs, "makeDirectory", "/storm");
+    double start = now();
+    for (int i = 0; i < count; i++) {
+        long long handle = call_integer(fs, "open", "/storm/" + std::to_string(i), "w");
+        call(fs, "write", handle, data);
+        call(fs, "close", handle);
+    }
+    report("create_small_files", data.size(), count, count * data.size(), now() - start);
+    start = now();
+    for (int i = 0; i < count; i++) call(fs, "remove", "/storm/" + std::to_string(i));
+    report("delete_small_files", data.size(), count, 0, now() - start);
+    call(fs, "remove", "/storm");
+}
+
+static void bench_list(Filesystem *fs, int entries) {
+    call(fs, "makeDirectory", "/big");
+    for (int i = 0; i < entries; i++) {
+        long long handle = call_integer(fs, "open", "/big/entry" + std::to_string(i), "w");
+        call(fs, "close", handle);
+    }
+    double start = now();
+    call(fs, "list", "/big");
+    report("list_cold", 0, 1, 0, now() - start);
+    start = now();
+    for (int i = 0; i < BENCH_LIST_REPEATS; i++) call(fs, "list", "/big");
+    report("list_warm", 0, BENCH_LIST_REPEATS, 0, now() - start);
+    start = now();
+    for (int i = 0; i < BENCH_LIST_REPEATS; i++) call(fs, "list", "/big", 5000LL, 100LL);
+    report("list_page", 100, BENCH_LIST_REPEATS, 0, now() - start);
+    call(fs, "remove", "/big");
+}
+
+static void bench_space_used(Filesystem *&fs, const string &project_dir, int depth) {
+    string path;
+    string data(1000, 'w');
+    for (int level = 0; level < depth; level++) {
+        path += "/level" + std::to_string(level);
+        call(fs, "makeDirectory", path);
+        for (int i = 0; i < BENCH_TREE_FILES; i++) {
+            long long handle = call_integer(fs, "open", path + "/file" + std::to_string(i), "w");
+            call(fs, "write", handle, data);
+            call(fs, "close", handle);
+        }
+    }
+    delete fs;
+    fs = open_filesystem(project_dir);
+    double start = now();
+    call(fs, "spaceUsed");
+    report("space_used_cold", 0, 1, 0, now() - start);
+    start = now();
+    for (int i = 0; i < BENCH_LIST_REPEATS; i++) {
+        long long handle = call_integer(fs, "open", path + "/file0", "a");
+        call(fs, "write", handle, data);
+        call(fs, "close", handle);
+        call(fs, "spaceUsed");
+    }
+    report("space_used_after_write", 0, BENCH_LIST_REPEATS, 0, now() - start);
+    call(fs, "remove", "/level0");
+}
+
+int main(int argc, char **argv) {
+    string work_dir = (argc > 1 ? std::filesystem::path(argv[1]) : std::filesystem::temp_directory_path()) / "bench_fs";
+    int scale = argc > 2 ? std::max(1, atoi(argv[2])) : 1;
+    string project_dir = work_dir + "/";
+    string folder = get_component_folder(project_dir, FILESYSTEM, BENCH_FILESYSTEM);
+    std::filesystem::remove_all(work_dir);
+    std::filesystem::create_directories(folder + FILESYSTEM_DATA_FOLDER);
+    std::ofstream(folder + COMPONENT_ADDRESS_FILE) << "bench-fs";
+    std::ofstream(folder + FILESYSTEM_BUFFER_SIZE_FILE) << BENCH_CHUNK_SIZES[std::size(BENCH_CHUNK_SIZES) - 1];
+
+    state = luaL_newstate();
+    Filesystem *fs = open_filesystem(project_dir);
+    bench_sequential(fs, BENCH_FILE_SIZE * scale);
+    bench_random(fs, BENCH_FILE_SIZE * scale);
+    bench_small_files(fs, BENCH_SMALL_FILES * scale);
+    bench_list(fs, BENCH_LIST_ENTRIES * scale);
+    bench_space_used(fs, project_dir, BENCH_TREE_DEPTH * scale);
+    delete fs;
+    lua_close(state);
+    std::filesystem::remove_all(work_dir);
+    return 0;
+}
+
+#pragma clang diagnostic pop
@@ -6,6 +6,14 @@
 #include <string>
 #include <fstream>
 #include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
 #include "lua_utf8.c"
 #include <lua5.3/lua.h>
 #include <SDL2/SDL_ttf.h>
@@ -38,21 +46,7 @@ int Component::load_components(const string &project_dir, std::map<string, Compo
         size_t dot_index = folder_name.find_last_of('.');
         string name = folder_name.substr(0, dot_index);
         string type = folder_name.substr(dot_index + 1);
-        Component *component = nullptr;
-        if (type == EEPROM) {
-            component = new Eeprom(project_dir, name);
-        } else if (type == FILESYSTEM) {
-            component = new Filesystem(project_dir, name);
-        } else if (type == SCREEN) {
-            component = new Screen(project_dir, name);
-        } else if (type == GPU) {
-            component = new Gpu(project_dir, name);
-        } else if (type == KEYBOARD) {
-            component = new Keyboard(project_dir, name);
-        } else if (type == INTERNET) {
-            component = new Internet(project_dir, name);
-        }
-
+        Component *component = load_component(project_dir, type, name);
         if (component) {
             components[name] = component;
             cnt++;
@@ -61,6 +55,43 @@ int Component::load_components(const string &project_dir, std::map<string, Compo
     return cnt;
 }
 
+Component *Component::load_component(const string &project_dir, const string &type, const string &name) {
+    Component *component = nullptr;
+    if (type == EEPROM) {
+        component = new Eeprom(project_dir, name);
+    } else if (type == FILESYSTEM) {
+        if (std::filesystem::is_regular_file(get_component_folder(project_dir, type, name) + FILESYSTEM_IMAGE_FILE))
+            component = new PackedFilesystem(project_dir, name);
+        else if (std::filesystem::is_regular_file(get_component_folder(project_dir, type, name) + FILESYSTEM_LOWER_FILE))
+            component = new OverlayFilesystem(project_dir, name);
+        else component = new Filesystem(project_dir, name);
+    } else if (type == SCREEN) {
+        component = new Screen(project_dir, name);
+    } else if (type == GPU) {
+        component = new Gpu(project_dir, name);
+    } else if (type == KEYBOARD) {
+        component = new Keyboard(project_dir, name);
+    } else if (type == INTERNET) {
+        component = new Internet(project_dir, name);
+    }
+    return component;
+}
+
+Component *Component::load_component(const string &project_dir, const string &name) {
+    for (const auto &entry : std::filesystem::directory_iterator(project_dir + COMPONENTS_FOLDER)) {
+        string path = entry.path();
+        string folder_name = path.substr(path.find_last_of("/\\") + 1);
+        size_t dot_index = folder_name.find_last_of('.');
+        if (folder_name.substr(0, dot_index) == name)
+            return load_component(project_dir, folder_name.substr(dot_index + 1), name);
+    }
+    return nullptr;
+}
+
+void Component::release_handles(Computer *) {
+
+}
+
 Component::~Component() = default;
 
 
@@ -154,26 +185,213 @@ string Eeprom::get_type() {
 Eeprom::~Eeprom() = default;
 
 
+// pushes entries of a directory listing as a table, list(path[, offset[, count]]) returns only a page of it
+static int push_listing(lua_State *state, const std::vector<string> &entries) {
+    size_t offset = 0;
+    size_t count = entries.size();
+    if (lua_gettop(state) >= 2 && lua_isnumber(state, 2)) offset = std::max(0LL, (long long) lua_tointeger(state, 2));
+    if (lua_gettop(state) >= 3 && lua_isnumber(state, 3)) count = std::max(0LL, (long long) lua_tointeger(state, 3));
+    offset = std::min(offset, entries.size());
+    count = std::min(count, entries.size() - offset);
+    lua_createtable(state, count, 1);
+    int table = lua_gettop(state);
+    for (size_t i = 0; i < count; i++) {
+        const string &name = entries[offset + i];
+        lua_pushlstring(state, name.data(), name.size());
+        lua_seti(state, table, i + 1);
+    }
+    lua_pushliteral(state, "n");
+    lua_pushinteger(state, count);
+    lua_settable(state, table);
+    return 1;
+}
+
+// never destroyed: flush_all() may run from exit() after static destructors
+static std::mutex &tracers_lock = *new std::mutex;
+static std::set<FilesystemTracer *> &tracers = *new std::set<FilesystemTracer *>;
+
+FilesystemTracer::FilesystemTracer(const string &component_folder) {
+    std::ifstream in(component_folder + FILESYSTEM_TRACE_FILE);
+    string format;
+    in >> format;
+    if (format == "binary") mode = Mode::BINARY;
+    else if (format == "summary") {
+        mode = Mode::SUMMARY;
+        int prefix_depth;
+        if (in >> prefix_depth && prefix_depth >= 0) depth = prefix_depth;
+    }
+    log.open(component_folder + FILESYSTEM_TRACE_LOG_FILE,
+             mode == Mode::BINARY ? std::ios::binary | std::ios::app : std::ios::app);
+    static std::once_flag exit_hook;
+    std::call_once(exit_hook, [] { atexit(flush_all); });
+    std::lock_guard<std::mutex> locker(tracers_lock);
+    tracers.insert(this);
+}
+
+void FilesystemTracer::flush_all() {
+    std::lock_guard<std::mutex> locker(tracers_lock);
+    for (FilesystemTracer *tracer : tracers) tracer->finish();
+}
+
+FilesystemTracer::Call FilesystemTracer::begin(const string &method, lua_State *state) {
+    Call call;
+    call.tracer = this;
+    call.method = method;
+    if (lua_type(state, 1) == LUA_TSTRING) {
+        call.path = "/" + Filesystem::normalize_path(lua_tostring(state, 1));
+    } else if (lua_isinteger(state, 1)) {
+        call.handle = lua_tointeger(state, 1);
+        auto it = handle_paths.find(call.handle);
+        if (it != handle_paths.end()) call.path = it->second;
+    }
+    if (method == "write" && lua_type(state, 2) == LUA_TSTRING) {
+        lua_tolstring(state, 2, &call.bytes);
+    }
+    call.start = std::chrono::steady_clock::now();
+    return call;
+}
+
+void FilesystemTracer::Call::finish(lua_State *state, int results) {
+    long long nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    if (method == "read" && results > 0 && lua_type(state, -results) == LUA_TSTRING) {
+        lua_tolstring(state, -results, &bytes);
+    }
+    if (method == "open" && results == 1 && lua_isinteger(state, -1)) {
+        handle = lua_tointeger(state, -1);
+        tracer->handle_paths[handle] = path;
+    }
+    tracer->record(*this, nanoseconds);
+    if (method == "close") tracer->handle_paths.erase(handle);
+}
+
+string FilesystemTracer::prefix_of(const string &path) const {
+    size_t end = 0;
+    for (int i = 0; i < depth && end != string::npos; i++) end = path.find('/', end + 1);
+    return path.substr(0, end);
+}
+
+void FilesystemTracer::record(const Call &call, long long nanoseconds) {
+    std::lock_guard<std::mutex> locker(lock);
+    if (finished) return;
+    if (mode == Mode::SUMMARY) {
+        Totals &total = totals[{call.method, prefix_of(call.path)}];
+        total.count++;
+        total.bytes += call.bytes;
+        total.nanoseconds += nanoseconds;
+        total.max_nanoseconds = std::max(total.max_nanoseconds, nanoseconds);
+        return;
+    }
+    long long time = std::chrono::duration_cast<std::chrono::microseconds>(call.start - created).count();
+    if (mode == Mode::BINARY) {
+        int64_t fields[] = {time, nanoseconds, (int64_t) call.bytes, call.handle};
+        uint16_t lengths[] = {(uint16_t) call.method.size(), (uint16_t) std::min<size_t>(call.path.size(), 65535)};
+        log.write((const char *) fields, sizeof(fields));
+        log.write((const char *) lengths, sizeof(lengths));
+        log.write(call.method.data(), lengths[0]);
+        log.write(call.path.data(), lengths[1]);
+    } else {
+        log << "{\"t\": " << time << ", \"op\": \"" << call.method << "\", \"path\": \"";
+        for (char c : call.path) {
+            if (c == '"' || c == '\\') log << '\\';
+            log << c;
+        }
+        log << "\", \"handle\": " << call.handle << ", \"bytes\": " << call.bytes << ", \"ns\": " << nanoseconds << "}\n";
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (now - last_flush >= std::chrono::milliseconds(FILESYSTEM_TRACE_FLUSH_INTERVAL)) {
+        log.flush();
+        last_flush = now;
+    }
+}
+
+void FilesystemTracer::finish() {
+    std::lock_guard<std::mutex> locker(lock);
+    if (finished) return;
+    finished = true;
+    for (const auto &[key, total] : totals) {
+        log << "{\"op\": \"" << key.first << "\", \"prefix\": \"" << key.second << "\", \"count\": " << total.count
+            << ", \"bytes\": " << total.bytes << ", \"ns\": " << total.nanoseconds
+            << ", \"max_ns\": " << total.max_nanoseconds << "}\n";
+    }
+    log.flush();
+}
+
+FilesystemTracer::~FilesystemTracer() {
+    {
+        std::lock_guard<std::mutex> locker(tracers_lock);
+        tracers.erase(this);
+    }
+    finish();
+}
+
+template<class T>
+T *HandleTable<T>::get(lua_State *state, int index) const {
+    int ok = 0;
+    long long id = lua_tointegerx(state, index, &ok);
+    return ok ? get(id) : nullptr;
+}
+
 Filesystem::Filesystem(const string &project_dir,
                        const string &name) : Component(name, get_component_address(project_dir, FILESYSTEM, name)),
+                                             data_directory(get_component_folder(project_dir, FILESYSTEM, name) +
+                                                            FILESYSTEM_DATA_FOLDER),
                                              project_dir(project_dir) {
-
+    std::ifstream in(get_component_folder(project_dir, FILESYSTEM, name) + FILESYSTEM_BUFFER_SIZE_FILE);
+    size_t size;
+    if (in >> size && size > 0) max_buffer_size = size;
+    in = std::ifstream(get_component_folder(project_dir, FILESYSTEM, name) + FILESYSTEM_HANDLE_BUFFER_SIZE_FILE);
+    if (in >> size) handle_buffer_size = size;
+    in = std::ifstream(get_component_folder(project_dir, FILESYSTEM, name) + FILESYSTEM_CAPACITY_FILE);
+    in >> capacity;
+    in = std::ifstream(get_component_folder(project_dir, FILESYSTEM, name) + FILESYSTEM_HANDLE_LIMIT_FILE);
+    if (in >> size) handle_limit = size;
+    descriptors.limit = handle_limit;
+    deduplicated = std::filesystem::is_regular_file(get_component_folder(project_dir, FILESYSTEM, name) +
+                                                    FILESYSTEM_DEDUP_MARKER);
+    if (is_readonly() &&
+        std::filesystem::is_regular_file(get_component_folder(project_dir, FILESYSTEM, name) + FILESYSTEM_PRELOAD_MARKER))
+        preload_thread = std::thread(&Filesystem::preload, this);
+    if (std::filesystem::is_regular_file(get_component_folder(project_dir, FILESYSTEM, name) + FILESYSTEM_TRACE_FILE))
+        tracer = new FilesystemTracer(get_component_folder(project_dir, FILESYSTEM, name));
+    in = std::ifstream(get_component_folder(project_dir, FILESYSTEM, name) + FILESYSTEM_DURABILITY_FILE);
+    string policy;
+    in >> policy;
+    if (policy == "close") durability = Durability::ON_CLOSE;
+    else if (policy == "write") durability = Durability::EVERY_WRITE;
+    else if (policy == "periodic") {
+        durability = Durability::PERIODIC;
+        long long interval;
+        if (in >> interval && interval > 0) sync_interval = interval;
+    }
 }
 
 int Filesystem::invoke(const string &method, lua_State *state) {
+    if (!tracer) return dispatch(method, state);
+    FilesystemTracer::Call call = tracer->begin(method, state);
+    int results = dispatch(method, state);
+    call.finish(state, results);
+    return results;
+}
+
+int Filesystem::dispatch(const string &method, lua_State *state) {
     if (method == "isDirectory") {
         if (lua_gettop(state) != 1) api_error(state, "isDirectory(): invalid number of arguments");
         auto *cPath = lua_tostring(state, 1);
         if (cPath) {
-            bool is_directory = std::filesystem::is_directory(get_data_directory() + string(cPath));
-            lua_pushboolean(state, is_directory);
+            lua_pushboolean(state, get_metadata(normalize_path(cPath)).directory);
             return 1;
         } else api_error(state, "isDirectory(): invalid type of argument #1");
     } else if (method == "makeDirectory") {
         if (lua_gettop(state) != 1) api_error(state, "makeDirectory(): invalid number of arguments");
         auto *cPath = lua_tostring(state, 1);
         if (cPath) {
-            bool ok = std::filesystem::create_directories(get_data_directory() + string(cPath));
+            std::error_code err;
+            bool ok = std::filesystem::create_directories(resolve(cPath), err);
+            // every missing ancestor was created as well
+            for (string path = normalize_path(cPath); !path.empty(); path = parent_path(path)) {
+                invalidate_path(path, false);
+            }
             lua_pushboolean(state, ok);
             return 1;
         } else api_error(state, "makeDirectory(): invalid type of argument #1");
@@ -181,50 +399,38 @@ int Filesystem::invoke(const string &method, lua_State *state) {
         if (lua_gettop(state) != 1) api_error(state, "exists(): invalid number of arguments");
         auto *cPath = lua_tostring(state, 1);
         if (cPath) {
-            string path = get_data_directory() + string(cPath);
-            bool exists = std::filesystem::exists(path);
-            lua_pushboolean(state, exists);
+            lua_pushboolean(state, get_metadata(normalize_path(cPath)).exists);
             return 1;
         } else api_error(state, "exists(): invalid type of argument #1");
     } else if (method == "size") {
         if (lua_gettop(state) != 1) api_error(state, "size(): invalid number of arguments");
         auto *cPath = lua_tostring(state, 1);
         if (cPath) {
-            string path = get_data_directory() + string(cPath);
-            std::error_code err;
-            long long size = std::filesystem::file_size(path, err);
-            if (err) {
-                lua_pushinteger(state, 0);
-                return 1;
-            } else {
-                lua_pushinteger(state, size);
-                return 1;
-            }
+            lua_pushinteger(state, get_metadata(normalize_path(cPath)).size);
+            return 1;
         } else api_error(state, "size(): invalid type of argument #1");
     } else if (method == "lastModified") {
-        if (lua_gettop(state) != 1) api_error(state, "size(): invalid number of arguments");
+        if (lua_gettop(state) != 1) api_error(state, "lastModified(): invalid number of arguments");
         auto *cPath = lua_tostring(state, 1);
         if (cPath) {
-            string path = get_data_directory() + string(cPath);
-            std::error_code err;
-            auto time = std::filesystem::last_write_time(path, err);
-            using std::chrono_literals::operator""s;
-            time += 6437664000s; // something about 204 years, idk why I should do it
-            if (err.value()) {
-                lua_pushinteger(state, 0);
-                return 1;
-            } else {
-                lua_pushinteger(state,
-                                std::chrono::duration_cast<std::chrono::seconds>(time.time_since_epoch()).count());
-                return 1;
-            }
+            lua_pushinteger(state, get_metadata(normalize_path(cPath)).modified);
+            return 1;
         } else api_error(state, "lastModified(): invalid type of argument #1");
     } else if (method == "remove") {
         if (lua_gettop(state) != 1) api_error(state, "remove(): invalid number of arguments");
         auto *cPath = lua_tostring(state, 1);
         if (cPath) {
-            string path = get_data_directory() + string(cPath);
-            int ok = std::filesystem::remove_all(path);
+            string relative = normalize_path(cPath);
+            if (relative.empty()) {
+                lua_pushboolean(state, false);
+                return 1;
+            }
+            string path = data_directory + relative;
+            unsigned long long size = used_space >= 0 ? tree_size(relative) : 0;
+            std::error_code err;
+            int ok = std::filesystem::remove_all(path, err);
+            if (ok > 0 && used_space >= 0) used_space -= size;
+            invalidate_path(relative, true);
             lua_pushboolean(state, ok > 0);
             return 1;
         } else api_error(state, "remove(): invalid type of argument #1");
@@ -233,10 +439,14 @@ int Filesystem::invoke(const string &method, lua_State *state) {
         auto *cPathSrc = lua_tostring(state, 1);
         auto *cPathDst = lua_tostring(state, 2);
         if (cPathSrc && cPathDst) {
-            string pathSrc = get_data_directory() + string(cPathSrc);
-            string pathDst = get_data_directory() + string(cPathDst);
+            const Metadata &replaced = get_metadata(normalize_path(cPathDst));
+            unsigned long long replaced_size = replaced.directory ? 0 : replaced.size;
+            string pathSrc = resolve(cPathSrc);
             std::error_code err;
-            std::filesystem::rename(pathSrc, pathDst, err);
+            std::filesystem::rename(pathSrc, resolve(cPathDst), err);
+            if (!err && used_space >= 0) used_space -= replaced_size;
+            invalidate_path(normalize_path(cPathSrc), true);
+            invalidate_path(normalize_path(cPathDst), true);
             lua_pushboolean(state, err.value() == 0);
             return 1;
         } else api_error(state, "rename(): invalid type of argument");
@@ -250,25 +460,62 @@ int Filesystem::invoke(const string &method, lua_State *state) {
             else api_error(state, "open(): invalid type of argument #2");
         }
         if (cPath) {
-            string path = get_data_directory() + string(cPath);
-            auto fMode = std::ios_base::in;
+            int flags;
             if (mode == "r" || mode == "rb") {
-                fMode = std::ios_base::in;
+                flags = O_RDONLY;
+            } else if (is_readonly()) {
+                lua_pushnil(state);
+                lua_pushliteral(state, "filesystem is read-only");
+                return 2;
             } else if (mode == "a" || mode == "ab") {
-                fMode = std::ios_base::out | std::ios_base::ate;
+                flags = O_WRONLY | O_CREAT;
             } else if (mode == "w" || mode == "wb") {
-                fMode = std::ios_base::out;
+                flags = O_WRONLY | O_CREAT | O_TRUNC;
             } else {
                 api_error(state, ("open(): unknown mode" + mode).c_str());
             }
-            auto *stream = new std::fstream(path, fMode);
-            auto *descriptor = new Descriptor(stream);
-            int descriptor_id = descriptors.size();
-            if (free_descriptors.empty()) descriptors.push_back(descriptor);
-            else {
-                descriptor_id = free_descriptors.front();
-                free_descriptors.pop();
-                descriptors[descriptor_id] = descriptor;
+            if (flags == O_RDONLY && preloaded.load(std::memory_order_acquire)) {
+                auto it = preload_index.find(normalize_path(cPath));
+                if (it != preload_index.end()) {
+                    auto *descriptor = new Descriptor(-1, std::make_shared<OpenFile>(), 0, 0);
+                    descriptor->mapping = preload_image.data() + it->second.first;
+                    descriptor->mapping_size = descriptor->file->size = it->second.second;
+                    long long descriptor_id = descriptors.insert(descriptor, computer);
+                    if (descriptor_id < 0) {
+                        delete descriptor;
+                        lua_pushnil(state);
+                        lua_pushliteral(state, "too many open handles");
+                        return 2;
+                    }
+                    lua_pushinteger(state, descriptor_id);
+                    return 1;
+                }
+            }
+            unsigned long long truncated = flags & O_TRUNC ? get_metadata(normalize_path(cPath)).size : 0;
+            if (flags != O_RDONLY && deduplicated && !BlobStore::unshare(resolve(cPath), flags & O_TRUNC)) {
+                lua_pushnil(state);
+                lua_pushstring(state, cPath);
+                return 2;
+            }
+            int fd = ::open(resolve(cPath).c_str(), flags | O_CLOEXEC, 0644);
+            if (fd >= 0 && used_space >= 0) used_space -= truncated;
+            if (fd < 0) {
+                lua_pushnil(state);
+                lua_pushstring(state, cPath);
+                return 2;
+            }
+            off_t position = flags & O_TRUNC || !(flags & O_CREAT) ? 0 : lseek(fd, 0, SEEK_END);
+            auto *descriptor = new Descriptor(fd, share_file(fd, flags & O_TRUNC), position, handle_buffer_size,
+                                              durability, sync_interval);
+            descriptor->path = normalize_path(cPath);
+            if (flags != O_RDONLY) invalidate_path(descriptor->path, false);
+            if (flags == O_RDONLY && is_readonly()) descriptor->map();
+            long long descriptor_id = descriptors.insert(descriptor, computer);
+            if (descriptor_id < 0) {
+                delete descriptor;
+                lua_pushnil(state);
+                lua_pushliteral(state, "too many open handles");
+                return 2;
             }
             //printf("filesystem.open(): new descriptor #%d, path '%s', mode '%s'\n", descriptor_id, cPath, mode.c_str());
             lua_pushinteger(state, descriptor_id);
@@ -277,105 +524,94 @@ int Filesystem::invoke(const string &method, lua_State *state) {
     } else if (method == "read") {
         if (lua_gettop(state) != 2) api_error(state, "read(): invalid number of arguments");
         int ok = 0;
-        int handle = lua_tointegerx(state, 1, &ok);
+        long long handle = lua_tointegerx(state, 1, &ok);
         if (ok == 0) api_error(state, "read(): invalid type of argument #1");
         double dCount = lua_tonumberx(state, 2, &ok);
         if (ok == 0) api_error(state, "read(): invalid type of argument #2");
-        int count = dCount;
-        if (count <= 0) count = INT32_MAX;
-        if (handle < 0 || handle >= descriptors.size()) api_error(state, "read(): no such descriptor");
-        Descriptor *descriptor = descriptors[handle];
+        size_t count = dCount > 0 ? std::min((double) max_buffer_size, dCount) : max_buffer_size;
+        Descriptor *descriptor = descriptors.get(handle);
         if (!descriptor) api_error(state, "read(): no such descriptor");
-        if (descriptor->stream->eof())
-            return 0;
-        count = std::min(FILESYSTEM_MAX_BUFFER_SIZE, count);
-        char *buffer = new char[count + 1];
-        descriptor->stream->read(buffer, count);
-        int read = descriptor->stream->gcount();
+        if (descriptor->mapping) {
+            std::string_view slice = descriptor->read_mapped(count);
+            if (slice.empty()) return 0;
+            lua_pushlstring(state, slice.data(), slice.size());
+            return 1;
+        }
+        luaL_Buffer buffer;
+        luaL_buffinit(state, &buffer);
+        ssize_t read = descriptor->read(luaL_prepbuffsize(&buffer, count), count);
+        if (read <= 0) return 0;
         //printf("filesystem.write(): read %d bytes from #%d\n", read, handle);
-        string real(buffer, read);
-        lua_pushstring(state, real.c_str());
+        luaL_addsize(&buffer, read);
+        luaL_pushresult(&buffer);
         return 1;
     } else if (method == "write") {
         if (lua_gettop(state) != 2) api_error(state, "write(): invalid number of arguments");
         int ok = 0;
-        int handle = lua_tointegerx(state, 1, &ok);
+        long long handle = lua_tointegerx(state, 1, &ok);
         if (ok == 0) api_error(state, "write(): invalid type of argument #1");
-        auto *cS = lua_tostring(state, 2);
+        size_t n = 0;
+        auto *cS = lua_tolstring(state, 2, &n);
         if (!cS) api_error(state, "write(): invalid type of argument #2");
-        if (handle < 0 || handle >= descriptors.size()) api_error(state, "read(): no such descriptor");
-        Descriptor *descriptor = descriptors[handle];
+        Descriptor *descriptor = descriptors.get(handle);
         if (!descriptor) api_error(state, "write(): no such descriptor");
-        int n = strlen(cS);
-        descriptor->stream->write(cS, n);
+        off_t end = descriptor->position + (off_t) n;
+        off_t size = descriptor->file->size; // other handles on the file may have grown it already
+        unsigned long long growth = end > size ? end - size : 0;
+        if (capacity && space_used() + growth > capacity) {
+            lua_pushnil(state);
+            lua_pushliteral(state, "not enough space");
+            return 2;
+        }
+        bool written = descriptor->write(cS, n);
+        if (written && used_space >= 0) used_space += growth;
+        invalidate_metadata(descriptor->path, false);
         //printf("filesystem.write(): wrote %d bytes to #%d\n", n, handle);
-        lua_pushboolean(state, !descriptor->stream->bad());
+        lua_pushboolean(state, written);
         return 1;
     } else if (method == "seek") {
         if (lua_gettop(state) != 3) api_error(state, "seek(): invalid number of arguments");
         int ok = 0;
-        int handle = lua_tointegerx(state, 1, &ok);
+        long long handle = lua_tointegerx(state, 1, &ok);
         if (ok == 0) api_error(state, "seek(): invalid type of argument #1");
         auto *cWhence = lua_tostring(state, 2);
         if(!cWhence) api_error(state, "seek(): invalid type of argument #2");
         string whence = cWhence;
         if(!lua_isnumber(state, 3)) api_error(state, "seek(): invalid type of argument #3");
         int off = lua_tonumber(state, 3);
-        if (handle < 0 || handle >= descriptors.size()) api_error(state, "seek(): no such descriptor");
-        Descriptor *descriptor = descriptors[handle];
+        Descriptor *descriptor = descriptors.get(handle);
         if (!descriptor) api_error(state, "seek(): no such descriptor");
-        int cur = descriptor->stream->tellg();
-        auto pos = std::fstream::cur;
+        int pos;
         if(whence == "cur") {
-            pos = std::fstream::cur;
-            if(-off > pos) off = -pos;
+            pos = SEEK_CUR;
         } else if(whence == "set") {
-            pos = std::fstream::beg;
+            pos = SEEK_SET;
             if(off < 0) off = 0;
         } else if(whence == "end") {
-            pos = std::fstream::end;
+            pos = SEEK_END;
             if(off > 0) off = 0;
         } else api_error(state, "seek(): invalid argument #2");
-        descriptor->stream->seekg(off, pos);
-        lua_pushinteger(state, descriptor->stream->tellg());
+        lua_pushinteger(state, descriptor->seek(off, pos));
         return 1;
     } else if (method == "close") {
         if (lua_gettop(state) != 1) api_error(state, "close(): invalid number of arguments");
         int ok = 0;
-        int handle = lua_tointegerx(state, 1, &ok);
+        long long handle = lua_tointegerx(state, 1, &ok);
         if (ok == 0) api_error(state, "close(): invalid type of argument #1");
-        if (handle < 0 || handle >= descriptors.size()) api_error(state, "close(): no such descriptor");
-        Descriptor *descriptor = descriptors[handle];
+        Descriptor *descriptor = descriptors.get(handle);
         if (!descriptor) api_error(state, "close(): no such descriptor");
-        descriptor->stream->flush();
-        descriptor->stream->close();
-        delete descriptor;
-        descriptors[handle] = nullptr;
-        free_descriptors.push(handle);
+        string path = descriptor->path;
+        descriptors.erase(handle);
+        invalidate_metadata(path, false); // buffered writes reached the file
         //printf("filesystem.close(): closed #%d\n", handle);
         return 0;
     } else if (method == "list") {
-        if (lua_gettop(state) != 1) api_error(state, "list(): invalid number of arguments");
+        if (lua_gettop(state) < 1 || lua_gettop(state) > 3) api_error(state, "list(): invalid number of arguments");
         auto *cPath = lua_tostring(state, 1);
         if (cPath) {
-            string rPath = cPath;
-            if (!std::filesystem::is_directory(get_data_directory() + rPath))
-                return 0;
-            lua_createtable(state, 0, 0);
-            int table = lua_gettop(state);
-            int n = 0;
-            for (const auto &entry : std::filesystem::directory_iterator(get_data_directory() + rPath)) {
-                n++;
-                string path = entry.path();
-                string name = path.substr(path.find_last_of("/\\") + 1);
-                if (entry.is_directory()) name += "/";
-                lua_pushstring(state, name.c_str());
-                lua_seti(state, table, n);
-            }
-            lua_pushliteral(state, "n");
-            lua_pushinteger(state, n);
-            lua_settable(state, table);
-            return 1;
+            const std::vector<string> *entries = get_listing(normalize_path(cPath));
+            if (!entries) return 0;
+            return push_listing(state, *entries);
         } else api_error(state, "list(): invalid type of argument #1");
     } else if (method == "isReadOnly") {
         lua_pushboolean(state, is_readonly());
@@ -391,7 +627,7 @@ int Filesystem::invoke(const string &method, lua_State *state) {
         lua_pushinteger(state, space_used());
         return 1;
     } else if (method == "spaceTotal") {
-        lua_pushinteger(state, std::filesystem::space(get_data_directory()).free + space_used());
+        lua_pushinteger(state, space_total());
         return 1;
     } else {
         string error = FILESYSTEM + ": no such method: ";
@@ -426,12 +662,170 @@ std::vector<std::pair<string, bool>> Filesystem::get_methods() {
     return result;
 }
 
+string Filesystem::normalize_path(const string &path) {
+    string result;
+    normalize_path(path, result);
+    return result;
+}
+
+// appends the canonical relative form of path to result, ".." never goes above what result already held
+void Filesystem::normalize_path(std::string_view path, string &result) {
+    size_t root = result.size();
+    size_t begin = 0;
+    while (begin < path.size()) {
+        size_t end = path.find('/', begin);
+        if (end == std::string_view::npos) end = path.size();
+        std::string_view part = path.substr(begin, end - begin);
+        if (part == "..") {
+            size_t slash = result.rfind('/');
+            result.resize(slash == string::npos || slash < root ? root : slash);
+        } else if (!part.empty() && part != ".") {
+            if (result.size() > root) result += '/';
+            result.append(part);
+        }
+        begin = end + 1;
+    }
+}
+
+const string &Filesystem::resolve(std::string_view path) {
+    resolved_path.assign(data_directory);
+    normalize_path(path, resolved_path);
+    return resolved_path;
+}
+
+string Filesystem::parent_path(const string &path) {
+    size_t slash = path.find_last_of('/');
+    return slash == string::npos ? "" : path.substr(0, slash);
+}
+
+long long Filesystem::seek_position(lua_State *state, long long position, long long size) {
+    auto *cWhence = lua_tostring(state, 2);
+    if (!cWhence) api_error(state, "seek(): invalid type of argument #2");
+    string whence = cWhence;
+    if (!lua_isnumber(state, 3)) api_error(state, "seek(): invalid type of argument #3");
+    long long off = lua_tonumber(state, 3);
+    if (whence == "cur") {
+        position += off;
+    } else if (whence == "set") {
+        position = off;
+    } else if (whence == "end") {
+        position = size + off;
+    } else api_error(state, "seek(): invalid argument #2");
+    return std::max(position, 0LL);
+}
+
+const Filesystem::Metadata &Filesystem::get_metadata(const string &path) {
+    sync_metadata_cache();
+    auto it = metadata_cache.find(path);
+    if (it != metadata_cache.end()) return it->second;
+    Metadata metadata;
+    struct stat st{};
+    if (stat((data_directory + path).c_str(), &st) == 0) {
+        metadata.exists = true;
+        metadata.directory = S_ISDIR(st.st_mode);
+        metadata.size = metadata.directory ? 0 : st.st_size;
+        metadata.modified = st.st_mtim.tv_sec;
+        if (metadata.directory) watch_directory(path);
+    }
+    // without a watch on the parent (missing, or out of inotify watches) nothing would tell us the entry changed
+    if (!watch_directory(parent_path(path))) return uncached_metadata = metadata;
+    return metadata_cache[path] = metadata;
+}
+
+// returns whether changes in the directory are reported, a missing directory cannot be watched
+bool Filesystem::watch_directory(const string &path) {
+    if (directory_watches.count(path)) return true;
+    if (inotify_fd < 0) inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0) return false;
+    int watch = inotify_add_watch(inotify_fd, (data_directory + path).c_str(),
+                                  IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                  IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+    if (watch < 0) return false;
+    watched_directories[watch] = path;
+    directory_watches[path] = watch;
+    return true;
+}
+
+void Filesystem::invalidate_metadata(const string &path, bool recursive) {
+    metadata_cache.erase(path);
+    listing_cache.erase(path);
+    if (!recursive) return;
+    string prefix = path.empty() ? "" : path + "/";
+    for (auto it = metadata_cache.begin(); it != metadata_cache.end();) {
+        if (it->first.rfind(prefix, 0) == 0) it = metadata_cache.erase(it);
+        else it++;
+    }
+    for (auto it = listing_cache.begin(); it != listing_cache.end();) {
+        if (it->first.rfind(prefix, 0) == 0) it = listing_cache.erase(it);
+        else it++;
+    }
+}
+
+// for changes made through this filesystem, which are not left to inotify to report
+void Filesystem::invalidate_path(const string &path, bool recursive) {
+    invalidate_metadata(path, recursive);
+    if (!path.empty()) invalidate_metadata(parent_path(path), false);
+}
+
+const std::vector<string> *Filesystem::get_listing(const string &path) {
+    if (!get_metadata(path).directory) return nullptr;
+    auto it = listing_cache.find(path);
+    if (it != listing_cache.end()) return &it->second;
+    if (!watch_directory(path)) return &(uncached_listing = scan_directory(data_directory + path));
+    return &(listing_cache[path] = scan_directory(data_directory + path));
+}
+
+std::vector<string> Filesystem::scan_directory(const string &directory) {
+    std::vector<string> entries;
+    std::error_code err;
+    for (const auto &entry : std::filesystem::directory_iterator(directory, err)) {
+        string name = entry.path().filename();
+        if (entry.is_directory(err)) name += "/";
+        entries.push_back(std::move(name));
+    }
+    std::sort(entries.begin(), entries.end());
+    return entries;
+}
+
+void Filesystem::sync_metadata_cache() {
+    if (inotify_fd < 0) return;
+    alignas(struct inotify_event) char buffer[4096];
+    ssize_t length;
+    while ((length = ::read(inotify_fd, buffer, sizeof(buffer))) > 0) {
+        for (char *p = buffer; p < buffer + length; p += sizeof(struct inotify_event) + ((struct inotify_event *) p)->len) {
+            auto *event = (struct inotify_event *) p;
+            if (event->mask & IN_Q_OVERFLOW) {
+                // the dropped events may have been for any watched directory
+                metadata_cache.clear();
+                listing_cache.clear();
+                continue;
+            }
+            auto it = watched_directories.find(event->wd);
+            if (it == watched_directories.end()) continue;
+            string directory = it->second;
+            if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                invalidate_metadata(directory, true);
+                if (event->mask & IN_IGNORED) {
+                    directory_watches.erase(directory);
+                    watched_directories.erase(it);
+                }
+                continue;
+            }
+            invalidate_metadata(directory, false);
+            if (event->len) {
+                string name = event->name;
+                invalidate_metadata(directory.empty() ? name : directory + "/" + name, event->mask & IN_ISDIR);
+            }
+        }
+    }
+}
+
 string Filesystem::get_type() {
     return FILESYSTEM;
 }
 
-string Filesystem::get_data_directory() {
-    return get_component_folder(project_dir, FILESYSTEM, name) + FILESYSTEM_DATA_FOLDER;
+const string &Filesystem::get_data_directory() {
+    return data_directory;
 }
 
 bool Filesystem::is_readonly() {
@@ -454,28 +848,1131 @@ void Filesystem::set_label(const string &label) {
 }
 
 unsigned long long Filesystem::space_used() {
+    if (used_space < 0) used_space = tree_size("");
+    return used_space;
+}
+
+unsigned long long Filesystem::space_total() {
+    if (capacity) return capacity;
+    std::error_code err;
+    return std::filesystem::space(data_directory, err).free + space_used();
+}
+
+unsigned long long Filesystem::tree_size(const string &path) {
+    const Metadata &metadata = get_metadata(path);
+    if (!metadata.directory) return metadata.size;
+    return directory_size(data_directory + path);
+}
+
+unsigned long long Filesystem::directory_size(const string &directory) {
     unsigned long long space = 0;
-    for(const auto& entry : std::filesystem::recursive_directory_iterator(get_component_folder(project_dir, FILESYSTEM, name) + FILESYSTEM_DATA_FOLDER)) {
-        if(entry.is_regular_file()) space += entry.file_size();
+    std::error_code err;
+    for (auto it = std::filesystem::recursive_directory_iterator(directory, err);
+         it != std::filesystem::recursive_directory_iterator(); it.increment(err)) {
+        if (it->is_regular_file(err)) space += it->file_size(err);
     }
     return space;
 }
 
+void Filesystem::release_handles(Computer *owner) {
+    descriptors.release(owner);
+}
+
+// reads every file of the tree into preload_image, open() serves reads from it once preloaded is set
+void Filesystem::preload() {
+    std::vector<std::pair<string, size_t>> files;
+    size_t total = 0;
+    std::error_code err;
+    for (auto it = std::filesystem::recursive_directory_iterator(data_directory, err);
+         !err && it != std::filesystem::recursive_directory_iterator(); it.increment(err)) {
+        if (!it->is_regular_file(err)) continue;
+        size_t size = it->file_size(err);
+        if (err) continue;
+        files.emplace_back(std::filesystem::relative(it->path(), data_directory, err), size);
+        total += size;
+    }
+    preload_image.resize(total);
+    size_t offset = 0;
+    for (const auto &[path, size] : files) {
+        int fd = ::open((data_directory + path).c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) continue;
+        size_t done = 0;
+        ssize_t n;
+        while (done < size && (n = pread(fd, preload_image.data() + offset + done, size - done, done)) > 0) done += n;
+        close(fd);
+        if (done == size) preload_index[path] = {offset, size};
+        offset += size;
+    }
+    preloaded.store(true, std::memory_order_release);
+}
+
 Filesystem::~Filesystem() {
-    for (Descriptor *descriptor : descriptors) {
-        delete descriptor;
+    if (preload_thread.joinable()) preload_thread.join();
+    if (inotify_fd >= 0) close(inotify_fd);
+    delete tracer;
+}
+
+std::shared_ptr<Filesystem::OpenFile> Filesystem::share_file(int fd, bool truncated) {
+    struct stat st{};
+    if (fstat(fd, &st) != 0) return std::make_shared<OpenFile>();
+    auto file = open_files[{st.st_dev, st.st_ino}].lock();
+    if (file) {
+        file->size = truncated ? st.st_size : std::max(file->size, st.st_size);
+        return file;
     }
-    delete &descriptors;
-    delete &free_descriptors;
+    std::erase_if(open_files, [](const auto &entry) { return entry.second.expired(); });
+    file = std::make_shared<OpenFile>();
+    file->size = st.st_size;
+    open_files[{st.st_dev, st.st_ino}] = file;
+    return file;
+}
+
+Filesystem::Descriptor::Descriptor(int fd, std::shared_ptr<OpenFile> file, off_t position, size_t buffer_size,
+                                   Durability durability, long long sync_interval)
+        : fd(fd), file(std::move(file)), position(position), buffer_size(buffer_size), durability(durability),
+          sync_interval(sync_interval), last_sync(get_current_time()) {}
+
+bool Filesystem::Descriptor::map() {
+    struct stat st{};
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) return false;
+    void *address = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (address == MAP_FAILED) return false;
+    mapping = static_cast<const char *>(address);
+    mapping_size = st.st_size;
+    owns_mapping = true;
+    return true;
 }
 
-Filesystem::Descriptor::Descriptor(std::fstream *stream) : stream(stream) {
+std::string_view Filesystem::Descriptor::read_mapped(size_t count) {
+    if (position >= (off_t) mapping_size) return {};
+    size_t n = std::min(count, mapping_size - position);
+    std::string_view slice(mapping + position, n);
+    position += n;
+    return slice;
+}
 
+ssize_t Filesystem::Descriptor::read(char *data, size_t count) {
+    if (!flush()) return -1;
+    // writes still buffered in another handle show up once that handle flushes
+    if (read_generation != file->generation) read_buffer.clear();
+    off_t buffered_end = read_offset + (off_t) read_buffer.size();
+    if (position >= read_offset && position < buffered_end) {
+        size_t n = std::min(count, (size_t) (buffered_end - position));
+        memcpy(data, read_buffer.data() + (position - read_offset), n);
+        position += n;
+        return n;
+    }
+    if (count >= buffer_size) {
+        ssize_t n = pread(fd, data, count, position);
+        if (n > 0) position += n;
+        return n;
+    }
+    read_buffer.resize(buffer_size);
+    ssize_t n = pread(fd, read_buffer.data(), buffer_size, position);
+    read_buffer.resize(std::max<ssize_t>(n, 0));
+    read_offset = position;
+    read_generation = file->generation;
+    if (n <= 0) return n;
+    n = std::min(count, (size_t) n);
+    memcpy(data, read_buffer.data(), n);
+    position += n;
+    return n;
+}
+
+bool Filesystem::Descriptor::write(const char *data, size_t count) {
+    read_buffer.clear();
+    dirty = true;
+    if (!write_buffer.empty() &&
+        (write_offset + (off_t) write_buffer.size() != position || write_buffer.size() + count > buffer_size)) {
+        if (!flush()) return false;
+    }
+    if (count >= buffer_size) {
+        file->generation++;
+        size_t written = 0;
+        while (written < count) {
+            ssize_t n = pwrite(fd, data + written, count - written, position + written);
+            if (n < 0) return false;
+            written += n;
+        }
+    } else {
+        if (write_buffer.empty()) write_offset = position;
+        write_buffer.insert(write_buffer.end(), data, data + count);
+    }
+    position += count;
+    file->size = std::max(file->size, position);
+    if (durability == Durability::EVERY_WRITE) return sync();
+    if (durability == Durability::PERIODIC && get_current_time() - last_sync >= sync_interval) return sync();
+    return true;
+}
+
+off_t Filesystem::Descriptor::seek(off_t offset, int whence) {
+    if (whence == SEEK_END) {
+        flush();
+        struct stat st{};
+        if (fd < 0) position = file->size + offset; // slice of a preloaded image
+        else if (fstat(fd, &st) == 0) position = st.st_size + offset;
+    } else if (whence == SEEK_CUR) {
+        position += offset;
+    } else {
+        position = offset;
+    }
+    if (position < 0) position = 0;
+    return position;
+}
+
+bool Filesystem::Descriptor::flush() {
+    if (write_buffer.empty()) return true;
+    file->generation++;
+    size_t written = 0;
+    while (written < write_buffer.size()) {
+        ssize_t n = pwrite(fd, write_buffer.data() + written, write_buffer.size() - written, write_offset + written);
+        if (n < 0) return false;
+        written += n;
+    }
+    write_buffer.clear();
+    return true;
+}
+
+bool Filesystem::Descriptor::sync() {
+    if (!flush()) return false;
+    if (dirty && fdatasync(fd) != 0) return false;
+    dirty = false;
+    last_sync = get_current_time();
+    return true;
 }
 
 Filesystem::Descriptor::~Descriptor() {
-    stream->close();
-    delete stream;
+    if (mapping && owns_mapping) munmap(const_cast<char *>(mapping), mapping_size);
+    if (durability == Durability::NONE) flush();
+    else sync();
+    if (fd >= 0) close(fd);
+}
+
+TmpFilesystem::TmpFilesystem(const string &project_dir, const string &name) : Filesystem(project_dir, name) {
+    handles.limit = handle_limit;
+    if (capacity == 0) capacity = TMPFS_DEFAULT_CAPACITY;
+    auto root = std::make_shared<Node>();
+    root->directory = true;
+    root->used = &used;
+    root->modified = get_current_time() / 1000;
+    nodes[""] = root;
+}
+
+std::shared_ptr<TmpFilesystem::Node> TmpFilesystem::find(const string &path) {
+    auto it = nodes.find(path);
+    return it == nodes.end() ? nullptr : it->second;
+}
+
+std::shared_ptr<TmpFilesystem::Node> TmpFilesystem::create(const string &path, bool directory) {
+    auto parent = find(parent_path(path));
+    if (!parent || !parent->directory) return nullptr;
+    auto node = std::make_shared<Node>();
+    node->directory = directory;
+    node->modified = get_current_time() / 1000;
+    node->used = &used;
+    nodes[path] = node;
+    parent->children.insert(path.substr(path.find_last_of('/') + 1));
+    parent->modified = node->modified;
+    return node;
+}
+
+size_t TmpFilesystem::remove_node(const string &path) {
+    auto node = find(path);
+    if (!node) return 0;
+    size_t removed = 1;
+    string prefix = path.empty() ? "" : path + "/";
+    // children unlink themselves from the parent, so iterate over a detached copy of the set
+    std::set<string> children;
+    children.swap(node->children);
+    for (const string &child : children) removed += remove_node(prefix + child);
+    if (!path.empty()) {
+        nodes.erase(path);
+        auto parent = find(parent_path(path));
+        parent->children.erase(path.substr(path.find_last_of('/') + 1));
+        parent->modified = get_current_time() / 1000;
+    }
+    return removed;
+}
+
+int TmpFilesystem::dispatch(const string &method, lua_State *state) {
+    if (method == "isDirectory") {
+        if (lua_gettop(state) != 1) api_error(state, "isDirectory(): invalid number of arguments");
+        auto *cPath = lua_tostring(state, 1);
+        if (!cPath) api_error(state, "isDirectory(): invalid type of argument #1");
+        auto node = find(normalize_path(cPath));
+        lua_pushboolean(state, node && node->directory);
+        return 1;
+    } else if (method == "makeDirectory") {
+        if (lua_gettop(state) != 1) api_error(state, "makeDirectory(): invalid number of arguments");
+        auto *cPath = lua_tostring(state, 1);
+        if (!cPath) api_error(state, "makeDirectory(): invalid type of argument #1");
+        string path = normalize_path(cPath);
+        if (find(path)) {
+            lua_pushboolean(state, false);
+            return 1;
+        }
+        std::vector<string> missing;
+        for (string p = path; !find(p); p = parent_path(p)) missing.push_back(p);
+        bool ok = true;
+        for (auto it = missing.rbegin(); it != missing.rend() && ok; it++) ok = create(*it, true) != nullptr;
+        lua_pushboolean(state, ok);
+        return 1;
+    } else if (method == "exists") {
+        if (lua_gettop(state) != 1) api_error(state, "exists(): invalid number of arguments");
+        auto *cPath = lua_tostring(state, 1);
+        if (!cPath) api_error(state, "exists(): invalid type of argument #1");
+        lua_pushboolean(state, find(normalize_path(cPath)) != nullptr);
+        return 1;
+    } else if (method == "size") {
+        if (lua_gettop(state) != 1) api_error(state, "size(): invalid number of arguments");
+        auto *cPath = lua_tostring(state, 1);
+        if (!cPath) api_error(state, "size(): invalid type of argument #1");
+        auto node = find(normalize_path(cPath));
+        lua_pushinteger(state, node ? node->data.size() : 0);
+        return 1;
+    } else if (method == "lastModified") {
+        if (lua_gettop(state) != 1) api_error(state, "lastModified(): invalid number of arguments");
+        auto *cPath = lua_tostring(state, 1);
+        if (!cPath) api_error(state, "lastModified(): invalid type of argument #1");
+        auto node = find(normalize_path(cPath));
+        lua_pushinteger(state, node ? node->modified : 0);
+        return 1;
+    } else if (method == "remove") {
+        if (lua_gettop(state) != 1) api_error(state, "remove(): invalid number of arguments");
+        auto *cPath = lua_tostring(state, 1);
+        if (!cPath) api_error(state, "remove(): invalid type of argument #1");
+        string path = normalize_path(cPath);
+        lua_pushboolean(state, !path.empty() && remove_node(path) > 0);
+        return 1;
+    } else if (method == "rename") {
+        if (lua_gettop(state) != 2) api_error(state, "rename(): invalid number of arguments");
+        auto *cPathSrc = lua_tostring(state, 1);
+        auto *cPathDst = lua_tostring(state, 2);
+        if (!cPathSrc || !cPathDst) api_error(state, "rename(): invalid type of argument");
+        string src = normalize_path(cPathSrc);
+        string dst = normalize_path(cPathDst);
+        auto node = find(src);
+        auto dst_parent = find(parent_path(dst));
+        if (src.empty() || !node || find(dst) || !dst_parent || !dst_parent->directory ||
+            dst.rfind(src + "/", 0) == 0) {
+            lua_pushboolean(state, false);
+            return 1;
+        }
+        std::vector<std::pair<string, std::shared_ptr<Node>>> moved;
+        for (auto &[path, child] : nodes) {
+            if (path.rfind(src + "/", 0) == 0) moved.emplace_back(dst + path.substr(src.size()), child);
+        }
+        for (auto &[path, child] : moved) nodes.erase(src + path.substr(dst.size()));
+        for (auto &[path, child] : moved) nodes[path] = child;
+        nodes.erase(src);
+        nodes[dst] = node;
+        auto src_parent = find(parent_path(src));
+        src_parent->children.erase(src.substr(src.find_last_of('/') + 1));
+        dst_parent->children.insert(dst.substr(dst.find_last_of('/') + 1));
+        src_parent->modified = dst_parent->modified = get_current_time() / 1000;
+        lua_pushboolean(state, true);
+        return 1;
+    } else if (method == "open") {
+        if (lua_gettop(state) < 1 || lua_gettop(state) > 2) api_error(state, "open(): invalid number of arguments");
+        auto *cPath = lua_tostring(state, 1);
+        if (!cPath) api_error(state, "open(): invalid type of argument #1");
+        string mode = "r";
+        if (lua_gettop(state) == 2) {
+            auto *cMode = lua_tostring(state, 2);
+            if (cMode) mode = cMode;
+            else api_error(state, "open(): invalid type of argument #2");
+        }
+        string path = normalize_path(cPath);
+        auto node = find(path);
+        auto *handle = new Handle;
+        if (mode == "r" || mode == "rb") {
+            handle->node = node;
+        } else if (mode == "a" || mode == "ab" || mode == "w" || mode == "wb") {
+            if (!node) node = create(path, false);
+            handle->node = node;
+            handle->writable = true;
+            if (node && !node->directory && mode[0] == 'w') {
+                used -= node->data.size();
+                node->data.clear();
+                node->modified = get_current_time() / 1000;
+            }
+            if (node) handle->position = node->data.size();
+        } else {
+            delete handle;
+            api_error(state, ("open(): unknown mode" + mode).c_str());
+        }
+        if (!handle->node || handle->node->directory) {
+            delete handle;
+            lua_pushnil(state);
+            lua_pushstring(state, cPath);
+            return 2;
+        }
+        long long handle_id = handles.insert(handle, computer);
+        if (handle_id < 0) {
+            delete handle;
+            lua_pushnil(state);
+            lua_pushliteral(state, "too many open handles");
+            return 2;
+        }
+        lua_pushinteger(state, handle_id);
+        return 1;
+    } else if (method == "read") {
+        if (lua_gettop(state) != 2) api_error(state, "read(): invalid number of arguments");
+        Handle *handle = handles.get(state, 1);
+        if (!handle) api_error(state, "read(): no such descriptor");
+        int ok = 0;
+        double dCount = lua_tonumberx(state, 2, &ok);
+        if (ok == 0) api_error(state, "read(): invalid type of argument #2");
+        size_t count = dCount > 0 ? std::min((double) max_buffer_size, dCount) : max_buffer_size;
+        const std::vector<char> &data = handle->node->data;
+        if (handle->position >= data.size()) return 0;
+        count = std::min(count, data.size() - handle->position);
+        lua_pushlstring(state, data.data() + handle->position, count);
+        handle->position += count;
+        return 1;
+    } else if (method == "write") {
+        if (lua_gettop(state) != 2) api_error(state, "write(): invalid number of arguments");
+        Handle *handle = handles.get(state, 1);
+        if (!handle || !handle->writable) api_error(state, "write(): no such descriptor");
+        size_t n = 0;
+        auto *cS = lua_tolstring(state, 2, &n);
+        if (!cS) api_error(state, "write(): invalid type of argument #2");
+        std::vector<char> &data = handle->node->data;
+        size_t end = handle->position + n;
+        if (end > data.size()) {
+            if (used + end - data.size() > capacity) {
+                lua_pushnil(state);
+                lua_pushliteral(state, "not enough space");
+                return 2;
+            }
+            used += end - data.size();
+            data.resize(end);
+        }
+        std::copy(cS, cS + n, data.begin() + handle->position);
+        handle->position = end;
+        handle->node->modified = get_current_time() / 1000;
+        lua_pushboolean(state, true);
+        return 1;
+    } else if (method == "seek") {
+        if (lua_gettop(state) != 3) api_error(state, "seek(): invalid number of arguments");
+        Handle *handle = handles.get(state, 1);
+        if (!handle) api_error(state, "seek(): no such descriptor");
+        handle->position = seek_position(state, handle->position, handle->node->data.size());
+        lua_pushinteger(state, handle->position);
+        return 1;
+    } else if (method == "close") {
+        if (lua_gettop(state) != 1) api_error(state, "close(): invalid number of arguments");
+        Handle *handle = handles.get(state, 1);
+        if (!handle) api_error(state, "close(): no such descriptor");
+        handles.erase(lua_tointeger(state, 1));
+        return 0;
+    } else if (method == "list") {
+        if (lua_gettop(state) < 1 || lua_gettop(state) > 3) api_error(state, "list(): invalid number of arguments");
+        auto *cPath = lua_tostring(state, 1);
+        if (!cPath) api_error(state, "list(): invalid type of argument #1");
+        string path = normalize_path(cPath);
+        auto node = find(path);
+        if (!node || !node->directory) return 0;
+        std::vector<string> entries;
+        entries.reserve(node->children.size());
+        string prefix = path.empty() ? "" : path + "/";
+        for (const string &child : node->children) {
+            entries.push_back(nodes[prefix + child]->directory ? child + "/" : child);
+        }
+        return push_listing(state, entries);
+    } else if (method == "isReadOnly") {
+        lua_pushboolean(state, false);
+        return 1;
+    } else if (method == "getLabel") {
+        lua_pushstring(state, label.c_str());
+        return 1;
+    } else if (method == "setLabel") {
+        auto *cLabel = lua_tostring(state, 1);
+        if (cLabel) label = cLabel;
+        lua_pushstring(state, label.c_str());
+        return 1;
+    } else if (method == "spaceUsed") {
+        lua_pushinteger(state, used);
+        return 1;
+    } else if (method == "spaceTotal") {
+        lua_pushinteger(state, capacity);
+        return 1;
+    } else {
+        string error = FILESYSTEM + ": no such method: ";
+        error += method;
+        std::cerr << error << std::endl;
+        lua_pushstring(state, error.c_str());
+        lua_error(state);
+        return 0;
+    }
+}
+
+void TmpFilesystem::release_handles(Computer *owner) {
+    handles.release(owner);
+}
+
+TmpFilesystem::~TmpFilesystem() = default;
+
+OverlayFilesystem::OverlayFilesystem(const string &project_dir, const string &name) : Filesystem(project_dir, name) {
+    handles.limit = handle_limit;
+    std::ifstream in(get_component_folder(project_dir, FILESYSTEM, name) + FILESYSTEM_LOWER_FILE);
+    string lower_name;
+    in >> lower_name;
+    lower = new Filesystem(project_dir, lower_name);
+    std::error_code err;
+    std::filesystem::create_directories(get_data_directory(), err);
+}
+
+string OverlayFilesystem::whiteout_of(const string &path) {
+    string parent = parent_path(path);
+    string name = path.substr(parent.empty() ? 0 : parent.size() + 1);
+    return (parent.empty() ? "" : parent + "/") + FILESYSTEM_WHITEOUT_PREFIX + name;
+}
+
+int OverlayFilesystem::invoke_layer(Filesystem *layer, const string &method, lua_State *state) {
+    return layer == this ? Filesystem::dispatch(method, state) : layer->invoke(method, state);
+}
+
+bool OverlayFilesystem::lower_visible(const string &path) {
+    if (path.empty()) return true;
+    size_t slash = 0;
+    while (true) {
+        slash = path.find('/', slash + 1);
+        string prefix = path.substr(0, slash);
+        string parent = parent_path(prefix);
+        if (get_metadata(whiteout_of(prefix)).exists) return false;
+        if (get_metadata((parent.empty() ? "" : parent + "/") + FILESYSTEM_OPAQUE_MARKER).exists) return false;
+        if (slash == string::npos) return true;
+    }
+}
+
+Filesystem *OverlayFilesystem::layer_of(const string &path) {
+    if (get_metadata(path).exists) return this;
+    if (lower_visible(path) && lower->get_metadata(path).exists) return lower;
+    return nullptr;
+}
+
+std::vector<string> OverlayFilesystem::merged_listing(const string &path) {
+    std::vector<string> entries;
+    std::set<string> names;
+    auto strip = [](const string &entry) {
+        return entry.back() == '/' ? entry.substr(0, entry.size() - 1) : entry;
+    };
+    string prefix = path.empty() ? "" : path + "/";
+    if (const std::vector<string> *upper_entries = get_listing(path)) {
+        for (const string &entry : *upper_entries) {
+            if (entry.rfind(FILESYSTEM_WHITEOUT_PREFIX, 0) == 0) continue;
+            entries.push_back(entry);
+            names.insert(strip(entry));
+        }
+    }
+    if (lower_visible(path) && !get_metadata(prefix + FILESYSTEM_OPAQUE_MARKER).exists) {
+        if (const std::vector<string> *lower_entries = lower->get_listing(path)) {
+            for (const string &entry : *lower_entries) {
+                string name = strip(entry);
+                if (names.count(name) || get_metadata(whiteout_of(prefix + name)).exists) continue;
+                entries.push_back(entry);
+            }
+        }
+    }
+    std::sort(entries.begin(), entries.end());
+    return entries;
+}
+
+bool OverlayFilesystem::make_upper_directory(const string &path) {
+    if (path.empty()) return true;
+    if (get_metadata(path).directory) return true;
+    if (!make_upper_directory(parent_path(path))) return false;
+    bool hidden = !lower_visible(path);
+    std::error_code err;
+    std::filesystem::remove(get_data_directory() + whiteout_of(path), err);
+    if (!std::filesystem::create_directory(get_data_directory() + path, err) && err) return false;
+    if (hidden && lower->get_metadata(path).exists) {
+        std::ofstream(get_data_directory() + (path + "/") + FILESYSTEM_OPAQUE_MARKER);
+    }
+    return true;
+}
+
+bool OverlayFilesystem::copy_up(const string &src, const string &dst) {
+    Filesystem *layer = layer_of(src);
+    if (!layer) return false;
+    Metadata metadata = layer->get_metadata(src);
+    std::error_code err;
+    if (metadata.directory) {
+        if (!make_upper_directory(dst)) return false;
+        string src_prefix = src.empty() ? "" : src + "/";
+        string dst_prefix = dst.empty() ? "" : dst + "/";
+        for (string entry : merged_listing(src)) {
+            if (entry.back() == '/') entry.pop_back();
+            if (!copy_up(src_prefix + entry, dst_prefix + entry)) return false;
+        }
+        return true;
+    }
+    if (!make_upper_directory(parent_path(dst))) return false;
+    std::filesystem::remove(get_data_directory() + whiteout_of(dst), err);
+    std::filesystem::copy_file(layer->get_data_directory() + src, get_data_directory() + dst,
+                               std::filesystem::copy_options::overwrite_existing, err);
+    if (!err && used_space >= 0) used_space += metadata.size;
+    return !err;
+}
+
+bool OverlayFilesystem::remove_path(const string &path) {
+    if (path.empty() || !layer_of(path)) return false;
+    bool in_lower = lower_visible(path) && lower->get_metadata(path).exists;
+    if (get_metadata(path).exists) {
+        unsigned long long size = used_space >= 0 ? tree_size(path) : 0;
+        std::error_code err;
+        std::filesystem::remove_all(get_data_directory() + path, err);
+        if (err) return false;
+        if (used_space >= 0) used_space -= size;
+    }
+    if (in_lower) {
+        if (!make_upper_directory(parent_path(path))) return false;
+        std::ofstream(get_data_directory() + whiteout_of(path));
+    }
+    return true;
+}
+
+bool OverlayFilesystem::has_directory(const string &path) {
+    Filesystem *layer = layer_of(path);
+    return layer && layer->get_metadata(path).directory;
+}
+
+bool OverlayFilesystem::rename_path(const string &src, const string &dst) {
+    if (src.empty() || !layer_of(src) || layer_of(dst) || dst.rfind(src + "/", 0) == 0) return false;
+    if (!has_directory(parent_path(dst))) return false;
+    if (lower_visible(src) && lower->get_metadata(src).exists) return copy_up(src, dst) && remove_path(src);
+    // only in the upper layer: moved in place, which keeps open handles and modification times
+    bool directory = get_metadata(src).directory;
+    if (!make_upper_directory(parent_path(dst))) return false;
+    std::error_code err;
+    std::filesystem::rename(get_data_directory() + src, get_data_directory() + dst, err);
+    if (err) return false;
+    std::filesystem::remove(get_data_directory() + whiteout_of(dst), err);
+    // dst is not visible, so whatever the lower layer has there stays hidden
+    if (directory && lower->get_metadata(dst).exists) {
+        std::ofstream(get_data_directory() + (dst + "/") + FILESYSTEM_OPAQUE_MARKER);
+    }
+    return true;
+}
+
+int OverlayFilesystem::dispatch(const string &method, lua_State *state) {
+    if (method == "isDirectory" || method == "exists" || method == "size" || method == "lastModified") {
+        if (lua_gettop(state) != 1) api_error(state, (method + "(): invalid number of arguments").c_str());
+        auto *cPath = lua_tostring(state, 1);
+        if (!cPath) api_error(state, (method + "(): invalid type of argument #1").c_str());
+        Filesystem *layer = layer_of(normalize_path(cPath));
+        return invoke_layer(layer ? layer : this, method, state);
+    } else if (method == "list") {
+        if (lua_gettop(state) < 1 || lua_gettop(state) > 3) api_error(state, "list(): invalid number of arguments");
+        auto *cPath = lua_tostring(state, 1);
+        if (!cPath) api_error(state, "list(): invalid type of argument #1");
+        string path = normalize_path(cPath);
+        Filesystem *layer = layer_of(path);
+        if (!layer || !layer->get_metadata(path).directory) return 0;
+        return push_listing(state, merged_listing(path));
+    } else if (method == "makeDirectory") {
+        if (lua_gettop(state) != 1) api_error(state, "makeDirectory(): invalid number of arguments");
+        auto *cPath = lua_tostring(state, 1);
+        if (!cPath) api_error(state, "makeDirectory(): invalid type of argument #1");
+        string path = normalize_path(cPath);
+        lua_pushboolean(state, !layer_of(path) && make_upper_directory(path));
+        return 1;
+    } else if (method == "remove") {
+        if (lua_gettop(state) != 1) api_error(state, "remove(): invalid number of arguments");
+        auto *cPath = lua_tostring(state, 1);
+        if (!cPath) api_error(state, "remove(): invalid type of argument #1");
+        lua_pushboolean(state, remove_path(normalize_path(cPath)));
+        return 1;
+    } else if (method == "rename") {
+        if (lua_gettop(state) != 2) api_error(state, "rename(): invalid number of arguments");
+        auto *cPathSrc = lua_tostring(state, 1);
+        auto *cPathDst = lua_tostring(state, 2);
+        if (!cPathSrc || !cPathDst) api_error(state, "rename(): invalid type of argument");
+        lua_pushboolean(state, rename_path(normalize_path(cPathSrc), normalize_path(cPathDst)));
+        return 1;
+    } else if (method == "open") {
+        if (lua_gettop(state) < 1 || lua_gettop(state) > 2) api_error(state, "open(): invalid number of arguments");
+        auto *cPath = lua_tostring(state, 1);
+        if (!cPath) api_error(state, "open(): invalid type of argument #1");
+        string mode = lua_gettop(state) == 2 && lua_tostring(state, 2) ? lua_tostring(state, 2) : "r";
+        string path = normalize_path(cPath);
+        Filesystem *layer = layer_of(path);
+        if (mode != "r" && mode != "rb") {
+            if (layer == lower && mode[0] == 'a') {
+                copy_up(path, path);
+            } else if (layer != this && !(has_directory(parent_path(path)) && make_upper_directory(parent_path(path)))) {
+                // like a plain filesystem, missing directories are not created
+                lua_pushnil(state);
+                lua_pushstring(state, cPath);
+                return 2;
+            }
+            std::error_code err;
+            std::filesystem::remove(get_data_directory() + whiteout_of(path), err);
+            layer = this;
+        }
+        int results = invoke_layer(layer ? layer : this, "open", state);
+        if (results != 1 || !lua_isinteger(state, -1)) return results;
+        auto *handle = new Handle{layer ? layer : this, lua_tointeger(state, -1)};
+        lua_pop(state, 1);
+        long long handle_id = handles.insert(handle, computer);
+        if (handle_id < 0) {
+            // the layer already opened its descriptor
+            lua_settop(state, 0);
+            lua_pushinteger(state, handle->handle);
+            invoke_layer(handle->layer, "close", state);
+            delete handle;
+            lua_settop(state, 0);
+            lua_pushnil(state);
+            lua_pushliteral(state, "too many open handles");
+            return 2;
+        }
+        lua_pushinteger(state, handle_id);
+        return 1;
+    } else if (method == "read" || method == "write" || method == "seek" || method == "close") {
+        if (lua_gettop(state) < 1) api_error(state, (method + "(): invalid number of arguments").c_str());
+        Handle *handle = handles.get(state, 1);
+        if (!handle) api_error(state, (method + "(): no such descriptor").c_str());
+        long long handle_id = lua_tointeger(state, 1);
+        lua_pushinteger(state, handle->handle);
+        lua_replace(state, 1);
+        int results = invoke_layer(handle->layer, method, state);
+        if (method == "close") handles.erase(handle_id);
+        return results;
+    } else {
+        return Filesystem::dispatch(method, state);
+    }
+}
+
+void OverlayFilesystem::release_handles(Computer *owner) {
+    handles.release(owner);
+    Filesystem::release_handles(owner);
+    lower->release_handles(lower->computer); // the lower layer is private to this filesystem, never attached
+}
+
+OverlayFilesystem::~OverlayFilesystem() {
+    delete lower;
+}
+
+PackedFilesystem::PackedFilesystem(const string &project_dir, const string &name) : Filesystem(project_dir, name) {
+    handles.limit = handle_limit;
+    string image_file = get_component_folder(project_dir, FILESYSTEM, name) + FILESYSTEM_IMAGE_FILE;
+    int fd = ::open(image_file.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st{};
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(Header)) {
+        std::cerr << "packed filesystem " << name << ": cannot open image" << std::endl;
+        if (fd >= 0) close(fd);
+        return;
+    }
+    void *address = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (address == MAP_FAILED) {
+        std::cerr << "packed filesystem " << name << ": cannot map image" << std::endl;
+        return;
+    }
+    image = static_cast<const char *>(address);
+    image_size = st.st_size;
+    auto *header = reinterpret_cast<const Header *>(image);
+    if (memcmp(header->magic, FILESYSTEM_IMAGE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != FILESYSTEM_IMAGE_VERSION ||
+        sizeof(Header) + (unsigned long long) header->entry_count * sizeof(Entry) > image_size) {
+        std::cerr << "packed filesystem " << name << ": invalid image" << std::endl;
+        return;
+    }
+    entries = reinterpret_cast<const Entry *>(image + sizeof(Header));
+    entry_count = header->entry_count;
+    for (size_t i = 0; i < entry_count; i++) {
+        const Entry &entry = entries[i];
+        // name_of() skips the separator after the parent
+        if (!valid_entry(entry, image_size) || (entry.parent_length && path_of(entry)[entry.parent_length] != '/')) {
+            std::cerr << "packed filesystem " << name << ": invalid image" << std::endl;
+            entry_count = 0;
+            files_size = 0;
+            return;
+        }
+        if (!entry.directory) files_size += entry.size;
+    }
+}
+
+// offsets come from the image, so they are compared without sums that could overflow
+bool PackedFilesystem::valid_entry(const Entry &entry, uint64_t image_size) {
+    if (entry.path_offset > image_size || entry.path_length > image_size - entry.path_offset) return false;
+    if (entry.parent_length && entry.parent_length >= entry.path_length) return false;
+    return entry.directory || (entry.data_offset <= image_size && entry.size <= image_size - entry.data_offset);
+}
+
+std::string_view PackedFilesystem::path_of(const Entry &entry) const {
+    return {image + entry.path_offset, entry.path_length};
+}
+
+std::string_view PackedFilesystem::parent_of(const Entry &entry) const {
+    return path_of(entry).substr(0, entry.parent_length);
+}
+
+std::string_view PackedFilesystem::name_of(const Entry &entry) const {
+    return path_of(entry).substr(entry.parent_length ? entry.parent_length + 1 : 0);
+}
+
+const PackedFilesystem::Entry *PackedFilesystem::find(const string &path) const {
+    string parent = parent_path(path);
+    std::string_view name = std::string_view(path).substr(parent.empty() ? 0 : parent.size() + 1);
+    const Entry *end = entries + entry_count;
+    const Entry *it = std::lower_bound(entries, end, std::make_pair(std::string_view(parent), name),
+                                       [this](const Entry &entry, const auto &key) {
+                                           return std::make_pair(parent_of(entry), name_of(entry)) < key;
+                                       });
+    if (it == end || parent_of(*it) != parent || name_of(*it) != name) return nullptr;
+    return it;
+}
+
+std::pair<const PackedFilesystem::Entry *, const PackedFilesystem::Entry *>
+PackedFilesystem::children(const string &path) const {
+    std::string_view parent = path;
+    const Entry *end = entries + entry_count;
+    const Entry *first = std::lower_bound(entries, end, parent, [this](const Entry &entry, std::string_view key) {
+        return parent_of(entry) < key;
+    });
+    const Entry *last = std::upper_bound(first, end, parent, [this](std::string_view key, const Entry &entry) {
+        return key < parent_of(entry);
+    });
+    return {first, last};
+}
+
+int PackedFilesystem::dispatch(const string &method, lua_State *state) {
+    if (method == "isDirectory" || method == "exists" || method == "size" || method == "lastModified") {
+        if (lua_gettop(state) != 1) api_error(state, (method + "(): invalid number of arguments").c_str());
+        auto *cPath = lua_tostring(state, 1);
+        if (!cPath) api_error(state, (method + "(): invalid type of argument #1").c_str());
+        string path = normalize_path(cPath);
+        const Entry *entry = find(path);
+        if (method == "isDirectory") lua_pushboolean(state, path.empty() || (entry && entry->directory));
+        else if (method == "exists") lua_pushboolean(state, path.empty() || entry);
+        else if (method == "size") lua_pushinteger(state, entry && !entry->directory ? entry->size : 0);
+        else lua_pushinteger(state, entry ? entry->modified : 0);
+        return 1;
+    } else if (method == "makeDirectory" || method == "remove" || method == "rename") {
+        lua_pushboolean(state, false);
+        return 1;
+    } else if (method == "open") {
+        if (lua_gettop(state) < 1 || lua_gettop(state) > 2) api_error(state, "open(): invalid number of arguments");
+        auto *cPath = lua_tostring(state, 1);
+        if (!cPath) api_error(state, "open(): invalid type of argument #1");
+        string mode = "r";
+        if (lua_gettop(state) == 2) {
+            auto *cMode = lua_tostring(state, 2);
+            if (cMode) mode = cMode;
+            else api_error(state, "open(): invalid type of argument #2");
+        }
+        if (mode != "r" && mode != "rb") {
+            lua_pushnil(state);
+            lua_pushliteral(state, "filesystem is read-only");
+            return 2;
+        }
+        const Entry *entry = find(normalize_path(cPath));
+        if (!entry || entry->directory) {
+            lua_pushnil(state);
+            lua_pushstring(state, cPath);
+            return 2;
+        }
+        auto *handle = new Handle{entry};
+        long long handle_id = handles.insert(handle, computer);
+        if (handle_id < 0) {
+            delete handle;
+            lua_pushnil(state);
+            lua_pushliteral(state, "too many open handles");
+            return 2;
+        }
+        lua_pushinteger(state, handle_id);
+        return 1;
+    } else if (method == "read") {
+        if (lua_gettop(state) != 2) api_error(state, "read(): invalid number of arguments");
+        Handle *handle = handles.get(state, 1);
+        if (!handle) api_error(state, "read(): no such descriptor");
+        int ok = 0;
+        double dCount = lua_tonumberx(state, 2, &ok);
+        if (ok == 0) api_error(state, "read(): invalid type of argument #2");
+        size_t count = dCount > 0 ? std::min((double) max_buffer_size, dCount) : max_buffer_size;
+        if (handle->position >= handle->entry->size) return 0;
+        count = std::min<uint64_t>(count, handle->entry->size - handle->position);
+        lua_pushlstring(state, image + handle->entry->data_offset + handle->position, count);
+        handle->position += count;
+        return 1;
+    } else if (method == "write") {
+        lua_pushnil(state);
+        lua_pushliteral(state, "filesystem is read-only");
+        return 2;
+    } else if (method == "seek") {
+        if (lua_gettop(state) != 3) api_error(state, "seek(): invalid number of arguments");
+        Handle *handle = handles.get(state, 1);
+        if (!handle) api_error(state, "seek(): no such descriptor");
+        handle->position = seek_position(state, handle->position, handle->entry->size);
+        lua_pushinteger(state, handle->position);
+        return 1;
+    } else if (method == "close") {
+        if (lua_gettop(state) != 1) api_error(state, "close(): invalid number of arguments");
+        Handle *handle = handles.get(state, 1);
+        if (!handle) api_error(state, "close(): no such descriptor");
+        handles.erase(lua_tointeger(state, 1));
+        return 0;
+    } else if (method == "list") {
+        if (lua_gettop(state) < 1 || lua_gettop(state) > 3) api_error(state, "list(): invalid number of arguments");
+        auto *cPath = lua_tostring(state, 1);
+        if (!cPath) api_error(state, "list(): invalid type of argument #1");
+        string path = normalize_path(cPath);
+        const Entry *entry = find(path);
+        if (!path.empty() && (!entry || !entry->directory)) return 0;
+        auto [first, last] = children(path);
+        std::vector<string> names;
+        names.reserve(last - first);
+        for (const Entry *it = first; it != last; it++) {
+            names.emplace_back(name_of(*it));
+            if (it->directory) names.back() += "/";
+        }
+        return push_listing(state, names);
+    } else if (method == "isReadOnly") {
+        lua_pushboolean(state, true);
+        return 1;
+    } else if (method == "spaceUsed" || method == "spaceTotal") {
+        lua_pushinteger(state, files_size);
+        return 1;
+    } else {
+        return Filesystem::dispatch(method, state);
+    }
+}
+
+bool PackedFilesystem::pack(const string &data_directory, const string &image_file) {
+    struct Source {
+        string path;
+        string parent;
+        string name;
+        bool directory;
+        uint64_t size;
+        int64_t modified;
+    };
+    std::vector<Source> sources;
+    std::error_code err;
+    for (auto it = std::filesystem::recursive_directory_iterator(data_directory, err);
+         !err && it != std::filesystem::recursive_directory_iterator(); it.increment(err)) {
+        Source source;
+        source.path = std::filesystem::relative(it->path(), data_directory, err);
+        source.parent = parent_path(source.path);
+        source.name = source.path.substr(source.parent.empty() ? 0 : source.parent.size() + 1);
+        source.directory = it->is_directory(err);
+        source.size = source.directory ? 0 : it->file_size(err);
+        struct stat st{};
+        source.modified = stat(it->path().c_str(), &st) == 0 ? st.st_mtim.tv_sec : 0;
+        sources.push_back(std::move(source));
+    }
+    if (err) {
+        std::cerr << "pack: " << err.message() << std::endl;
+        return false;
+    }
+    std::sort(sources.begin(), sources.end(), [](const Source &a, const Source &b) {
+        return std::tie(a.parent, a.name) < std::tie(b.parent, b.name);
+    });
+    Header header{};
+    memcpy(header.magic, FILESYSTEM_IMAGE_MAGIC, sizeof(header.magic));
+    header.version = FILESYSTEM_IMAGE_VERSION;
+    header.entry_count = sources.size();
+    uint64_t path_offset = sizeof(Header) + sources.size() * sizeof(Entry);
+    uint64_t data_offset = path_offset;
+    for (const Source &source : sources) data_offset += source.path.size();
+    std::vector<Entry> index;
+    for (const Source &source : sources) {
+        Entry entry{};
+        entry.path_offset = path_offset;
+        entry.path_length = source.path.size();
+        entry.parent_length = source.parent.size();
+        entry.data_offset = source.directory ? 0 : data_offset;
+        entry.size = source.size;
+        entry.modified = source.modified;
+        entry.directory = source.directory;
+        index.push_back(entry);
+        path_offset += source.path.size();
+        if (!source.directory) data_offset += source.size;
+    }
+    string temp_file = image_file + ".tmp";
+    std::ofstream out(temp_file, std::ios_base::binary | std::ios_base::trunc);
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(index.data()), index.size() * sizeof(Entry));
+    for (const Source &source : sources) out.write(source.path.data(), source.path.size());
+    for (const Source &source : sources) {
+        if (source.directory) continue;
+        std::ifstream in(data_directory + source.path, std::ios_base::binary);
+        if (source.size) out << in.rdbuf();
+    }
+    out.close();
+    if (!out || (uint64_t) std::filesystem::file_size(temp_file, err) != data_offset) {
+        std::cerr << "pack: failed to write " << image_file << std::endl;
+        std::filesystem::remove(temp_file, err);
+        return false;
+    }
+    std::filesystem::rename(temp_file, image_file, err);
+    return !err;
+}
+
+bool PackedFilesystem::unpack(const string &image_file, const string &data_directory) {
+    std::error_code err;
+    uint64_t image_size = std::filesystem::file_size(image_file, err);
+    std::ifstream in(image_file, std::ios_base::binary);
+    Header header{};
+    in.read(reinterpret_cast<char *>(&header), sizeof(header));
+    if (err || !in || memcmp(header.magic, FILESYSTEM_IMAGE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != FILESYSTEM_IMAGE_VERSION ||
+        sizeof(Header) + (uint64_t) header.entry_count * sizeof(Entry) > image_size) {
+        std::cerr << "unpack: invalid image " << image_file << std::endl;
+        return false;
+    }
+    std::vector<Entry> index(header.entry_count);
+    in.read(reinterpret_cast<char *>(index.data()), index.size() * sizeof(Entry));
+    if (!in || !std::all_of(index.begin(), index.end(), [image_size](const Entry &entry) {
+        return valid_entry(entry, image_size);
+    })) {
+        std::cerr << "unpack: invalid image " << image_file << std::endl;
+        return false;
+    }
+    std::filesystem::create_directories(data_directory, err);
+    std::vector<char> buffer;
+    for (const Entry &entry : index) {
+        string path(entry.path_length, '\0');
+        in.seekg(entry.path_offset);
+        in.read(path.data(), path.size());
+        path = data_directory + normalize_path(path);
+        if (entry.directory) {
+            std::filesystem::create_directories(path, err);
+        } else {
+            buffer.resize(entry.size);
+            in.seekg(entry.data_offset);
+            in.read(buffer.data(), buffer.size());
+            std::ofstream out(path, std::ios_base::binary | std::ios_base::trunc);
+            out.write(buffer.data(), buffer.size());
+            if (!in || !out) {
+                std::cerr << "unpack: failed to extract " << path << std::endl;
+                return false;
+            }
+        }
+    }
+    // directory times are restored last, extracting their contents changes them
+    for (auto it = index.rbegin(); it != index.rend(); it++) {
+        string path(it->path_length, '\0');
+        in.seekg(it->path_offset);
+        in.read(path.data(), path.size());
+        struct timespec times[2] = {{it->modified, 0}, {it->modified, 0}};
+        utimensat(AT_FDCWD, (data_directory + normalize_path(path)).c_str(), times, 0);
+    }
+    return true;
+}
+
+void PackedFilesystem::release_handles(Computer *owner) {
+    handles.release(owner);
+}
+
+PackedFilesystem::~PackedFilesystem() {
+    if (image) munmap(const_cast<char *>(image), image_size);
+}
+
+string BlobStore::hash_file(const string &file) {
+    int fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return "";
+    uint64_t hash = 14695981039346656037ULL; // FNV-1a
+    unsigned long long size = 0;
+    char buffer[65536];
+    ssize_t n;
+    while ((n = ::read(fd, buffer, sizeof(buffer))) > 0) {
+        for (ssize_t i = 0; i < n; i++) {
+            hash = (hash ^ (unsigned char) buffer[i]) * 1099511628211ULL;
+        }
+        size += n;
+    }
+    close(fd);
+    if (n < 0) return "";
+    char key[64];
+    snprintf(key, sizeof(key), "%llu-%016llx", size, (unsigned long long) hash);
+    return key;
+}
+
+bool BlobStore::same_content(const string &file, const string &other) {
+    std::ifstream a(file, std::ios::binary), b(other, std::ios::binary);
+    return a && b && std::equal(std::istreambuf_iterator<char>(a), std::istreambuf_iterator<char>(),
+                                std::istreambuf_iterator<char>(b), std::istreambuf_iterator<char>());
+}
+
+bool BlobStore::deduplicate(const string &project_dir, const string &name) {
+    string folder = get_component_folder(project_dir, FILESYSTEM, name);
+    string store = project_dir + STORE_FOLDER;
+    std::error_code err;
+    std::filesystem::create_directories(store, err);
+    if (!std::filesystem::is_directory(folder + FILESYSTEM_DATA_FOLDER) || err) return false;
+    bool failed = false;
+    for (auto it = std::filesystem::recursive_directory_iterator(folder + FILESYSTEM_DATA_FOLDER, err);
+         !err && it != std::filesystem::recursive_directory_iterator(); it.increment(err)) {
+        if (!it->is_regular_file(err) || it->is_symlink(err)) continue;
+        string file = it->path();
+        string key = hash_file(file);
+        if (key.empty()) continue;
+        struct stat st{};
+        if (stat(file.c_str(), &st) != 0) continue;
+        int error = 0;
+        // same hash and size but different bytes gets a numbered blob of its own
+        for (int n = 0;; n++) {
+            string blob = store + key + (n ? "-" + std::to_string(n) : "");
+            struct stat blob_st{};
+            if (stat(blob.c_str(), &blob_st) != 0) {
+                if (link(file.c_str(), blob.c_str()) != 0) error = errno;
+                break;
+            }
+            if (blob_st.st_ino == st.st_ino && blob_st.st_dev == st.st_dev) break;
+            if (same_content(file, blob)) {
+                string temp = file + ".dedup~";
+                if (link(blob.c_str(), temp.c_str()) != 0) {
+                    error = errno;
+                } else if (rename(temp.c_str(), file.c_str()) != 0) {
+                    error = errno;
+                    unlink(temp.c_str());
+                }
+                break;
+            }
+        }
+        // a failed file is left unshared, the store on another device (EXDEV) fails them all
+        if (error) {
+            failed = true;
+            std::cerr << "dedup: " << file << ": " << strerror(error) << std::endl;
+            if (error == EXDEV) break;
+        }
+    }
+    // files linked so far are shared and need copy-on-write even if the rest failed
+    std::ofstream(folder + FILESYSTEM_DEDUP_MARKER);
+    if (err) std::cerr << "dedup: " << err.message() << std::endl;
+    return !failed && !err;
+}
+
+// removes blobs no filesystem links to anymore, returns how many
+int BlobStore::collect(const string &project_dir) {
+    int removed = 0;
+    std::error_code err;
+    for (const auto &entry : std::filesystem::directory_iterator(project_dir + STORE_FOLDER, err)) {
+        struct stat st{};
+        if (stat(entry.path().c_str(), &st) == 0 && S_ISREG(st.st_mode) && st.st_nlink == 1 &&
+            unlink(entry.path().c_str()) == 0) {
+            removed++;
+        }
+    }
+    return removed;
+}
+
+// copy-on-write: gives a file shared with the store its own inode before it is modified
+bool BlobStore::unshare(const string &file, bool truncate) {
+    struct stat st{};
+    if (stat(file.c_str(), &st) != 0 || st.st_nlink <= 1) return true;
+    if (truncate) return unlink(file.c_str()) == 0;
+    string temp = file + ".cow~";
+    std::error_code err;
+    std::filesystem::copy_file(file, temp, std::filesystem::copy_options::overwrite_existing, err);
+    if (err || rename(temp.c_str(), file.c_str()) != 0) {
+        unlink(temp.c_str());
+        return false;
+    }
+    return true;
 }
 
 Screen::Screen(const string &project_dir,
@@ -491,18 +1988,23 @@ Screen::Screen(const string &project_dir,
     while (in >> keyboard) {
         keyboards.push_back(keyboard);
     }
+    renderer = std::thread(&Screen::render_loop, this);
 }
 
 int Screen::invoke(const string &method, lua_State *state) {
     if (method == "getKeyboards") {
         lua_createtable(state, keyboards.size(), 1);
         int keyboards_table = lua_gettop(state);
-        for (int i = 0; i < keyboards.size(); i++) {
-            lua_pushstring(state, computer->get_component_by_name(keyboards[i])->address.c_str());
-            lua_seti(state, keyboards_table, i + 1);
+        int n = 0;
+        for (const string &name : keyboards) {
+            // detached keyboards are left out
+            Component *keyboard = computer->get_component_by_name(name);
+            if (!keyboard) continue;
+            lua_pushstring(state, keyboard->address.c_str());
+            lua_seti(state, keyboards_table, ++n);
         }
         lua_pushliteral(state, "n");
-        lua_pushinteger(state, keyboards.size());
+        lua_pushinteger(state, n);
         lua_settable(state, keyboards_table);
         return 1;
     } else {
@@ -526,30 +2028,24 @@ string Screen::get_type() {
 }
 
 void Screen::update_size(int w, int h) {
-    if (bg_buffer) {
-        for (int i = 0; i < width; i++) {
-            delete[] bg_buffer[i];
-            delete[] fg_buffer[i];
-            delete[] ch_buffer[i];
-        }
-        delete[] bg_buffer;
-        delete[] fg_buffer;
-        delete[] ch_buffer;
-    }
-    bg_buffer = new unsigned int *[w];
-    fg_buffer = new unsigned int *[w];
-    ch_buffer = new unsigned int *[w];
-    for (int i = 0; i < w; i++) {
-        bg_buffer[i] = new unsigned int[h];
-        fg_buffer[i] = new unsigned int[h];
-        ch_buffer[i] = new unsigned int[h];
-    }
+    std::lock_guard<std::mutex> locker(grid_lock);
+    bg_buffer.assign(w * h, 0);
+    fg_buffer.assign(w * h, 0);
+    ch_buffer.assign(w * h, 0);
     width = w;
     height = h;
     viewport_width = w;
     viewport_height = h;
+    damage.clear();
+    moves.clear();
+    resized = true;
+    render_notifier.notify_one();
+}
+
+// runs on the render thread with grid_lock released, the window is resized and cleared
+void Screen::resize_window(int w, int h) {
     SDL_SetWindowSize(window, w * SCREEN_FONT_WIDTH, h * SCREEN_FONT_HEIGHT);
-    SDL_Rect rect;
+    SDL_Rect rect = {0, 0, 0, 0};
     SDL_GetWindowSize(window, &rect.w, &rect.h);
     SDL_FillRect(surface, &rect, 0xFFFF);
     SDL_Delay(100);
@@ -559,10 +2055,33 @@ void Screen::update_size(int w, int h) {
     }
 }
 
+// runs on the render thread, shifts the rows of the window surface the same way Screen::copy shifts cells,
+// fails when the surface no longer covers the region
+bool Screen::move_pixels(const Move &move) {
+    int bpp = surface->format->BytesPerPixel;
+    int x = move.from.x * SCREEN_FONT_WIDTH, y = move.from.y * SCREEN_FONT_HEIGHT;
+    int w = move.from.w * SCREEN_FONT_WIDTH, h = move.from.h * SCREEN_FONT_HEIGHT;
+    int dx = move.tx * SCREEN_FONT_WIDTH, dy = move.ty * SCREEN_FONT_HEIGHT;
+    if (x < 0 || y < 0 || x + w > surface->w || y + h > surface->h) return false;
+    if (x + dx < 0 || y + dy < 0 || x + dx + w > surface->w || y + dy + h > surface->h) return false;
+    if (SDL_MUSTLOCK(surface)) SDL_LockSurface(surface);
+    auto *pixels = (char *) surface->pixels;
+    for (int row = 0; row < h; row++) {
+        int py = dy > 0 ? y + h - 1 - row : y + row;
+        memmove(pixels + (py + dy) * surface->pitch + (x + dx) * bpp, pixels + py * surface->pitch + x * bpp, w * bpp);
+    }
+    if (SDL_MUSTLOCK(surface)) SDL_UnlockSurface(surface);
+    return true;
+}
 
 static TTF_Font *font = nullptr;
+// fonts are shared by all screens, and every screen renders on its own thread
+static std::mutex font_lock;
 
-void Screen::draw_char(int x, int y, unsigned int bg, unsigned int fg, unsigned int c) {
+SDL_Surface *Screen::get_glyph(unsigned int c) {
+    auto it = glyphs.find(c);
+    if (it != glyphs.end()) return it->second;
+    std::lock_guard<std::mutex> locker(font_lock);
     if (font == nullptr) {
         font = TTF_OpenFont((project_dir + SCREEN_FONT_FILE).c_str(), 16);
         if (font == nullptr) {
@@ -571,7 +2090,21 @@ void Screen::draw_char(int x, int y, unsigned int bg, unsigned int fg, unsigned
             exit(1);
         }
     }
-    bg |= 0xFF000000;
+    SDL_Color white = {0xFF, 0xFF, 0xFF, 0xFF};
+    SDL_Surface *rendered = TTF_RenderGlyph_Solid(font, c, white);
+    SDL_Surface *glyph = nullptr;
+    if (rendered) {
+        // the color key of the solid render becomes alpha, so the mask blends over the background
+        glyph = SDL_ConvertSurfaceFormat(rendered, SDL_PIXELFORMAT_ARGB8888, 0);
+        SDL_FreeSurface(rendered);
+        if (glyph) SDL_SetSurfaceBlendMode(glyph, SDL_BLENDMODE_BLEND);
+    }
+    glyphs[c] = glyph;
+    return glyph;
+}
+
+void Screen::draw_char(int x, int y, unsigned int bg, unsigned int fg, unsigned int c) {
+    SDL_Surface *glyph = get_glyph(c);
     unsigned int rb = (bg & 0xFF0000U) >> 16U;
     unsigned int gb = (bg & 0x00FF00U) >> 8U;
     unsigned int bb = (bg & 0x0000FFU);
@@ -584,32 +2117,182 @@ void Screen::draw_char(int x, int y, unsigned int bg, unsigned int fg, unsigned
     rect.w = SCREEN_FONT_WIDTH;
     rect.h = SCREEN_FONT_HEIGHT;
     SDL_FillRect(surface, &rect, SDL_MapRGB(surface->format, rb, gb, bb));
-    SDL_Color color;
-    color.r = rf;
-    color.g = gf;
-    color.b = bf;
-    color.a = 0xFF;
-    SDL_Surface *text_surface = TTF_RenderGlyph_Solid(font, c, color);
-    SDL_BlitSurface(text_surface, NULL, surface, &rect);
-    SDL_FreeSurface(text_surface);
+    if (glyph) {
+        SDL_SetSurfaceColorMod(glyph, rf, gf, bf);
+        SDL_BlitSurface(glyph, NULL, surface, &rect);
+    }
 }
 
 void Screen::set_char(int x, int y, unsigned int bg, unsigned int fg, unsigned int c) {
-    bg_buffer[x][y] = bg;
-    fg_buffer[x][y] = fg;
-    ch_buffer[x][y] = c;
-    draw_char(x, y, bg, fg, c);
+    std::lock_guard<std::mutex> locker(grid_lock);
+    int i = index(x, y);
+    if (bg_buffer[i] == bg && fg_buffer[i] == fg && ch_buffer[i] == c) return;
+    bg_buffer[i] = bg;
+    fg_buffer[i] = fg;
+    ch_buffer[i] = c;
+    mark_dirty(x, y, 1, 1);
+}
+
+// the region must lie within the screen
+void Screen::fill(int x, int y, int w, int h, unsigned int bg, unsigned int fg, unsigned int c) {
+    if (w <= 0 || h <= 0) return;
+    std::lock_guard<std::mutex> locker(grid_lock);
+    for (int cy = y; cy < y + h; cy++) {
+        int i = index(x, cy);
+        // redraws often fill rows that already hold the same cells, those are left out of the damage
+        auto same = [i, w](const std::vector<unsigned int> &plane, unsigned int value) {
+            return std::all_of(plane.begin() + i, plane.begin() + i + w, [value](unsigned int v) { return v == value; });
+        };
+        if (same(bg_buffer, bg) && same(fg_buffer, fg) && same(ch_buffer, c)) continue;
+        std::fill_n(bg_buffer.begin() + i, w, bg);
+        std::fill_n(fg_buffer.begin() + i, w, fg);
+        std::fill_n(ch_buffer.begin() + i, w, c);
+        mark_dirty(x, cy, w, 1);
+    }
+}
+
+// moves a region by (tx, ty) like memmove, parts falling outside the screen are dropped
+int Screen::copy(int x, int y, int w, int h, int tx, int ty) {
+    int x1 = std::max({x, 0, -tx}), y1 = std::max({y, 0, -ty});
+    int x2 = std::min({x + w, width, width - tx}), y2 = std::min({y + h, height, height - ty});
+    if (x1 >= x2 || y1 >= y2) return 0;
+    if (tx == 0 && ty == 0) return (x2 - x1) * (y2 - y1);
+    std::lock_guard<std::mutex> locker(grid_lock);
+    int count = x2 - x1;
+    // rows moving down are copied bottom-up so that the source is read before it is overwritten
+    for (int row = 0; row < y2 - y1; row++) {
+        int cy = ty > 0 ? y2 - 1 - row : y1 + row;
+        int from = index(x1, cy), to = index(x1 + tx, cy + ty);
+        memmove(bg_buffer.data() + to, bg_buffer.data() + from, count * sizeof(unsigned int));
+        memmove(fg_buffer.data() + to, fg_buffer.data() + from, count * sizeof(unsigned int));
+        memmove(ch_buffer.data() + to, ch_buffer.data() + from, count * sizeof(unsigned int));
+    }
+    // the window already shows the source unless it was drawn to since the last frame, so it can be moved as pixels
+    SDL_Rect from = {x1, y1, count, y2 - y1};
+    bool drawn = std::any_of(damage.begin(), damage.end(), [&from](const SDL_Rect &r) {
+        return r.x < from.x + from.w && from.x < r.x + r.w && r.y < from.y + from.h && from.y < r.y + r.h;
+    });
+    if (drawn || moves.size() >= SCREEN_MOVES) mark_dirty(x1 + tx, y1 + ty, count, y2 - y1);
+    else moves.push_back({from, tx, ty});
+    return count * (y2 - y1);
+}
+
+// takes a region in cells with grid_lock held, extends the last rectangle when the region continues it
+void Screen::mark_dirty(int x, int y, int w, int h) {
+    SDL_Rect rect = {x, y, w, h};
+    if (!damage.empty()) {
+        SDL_Rect &last = damage.back();
+        if (last.y == rect.y && last.h == rect.h && last.x + last.w == rect.x) {
+            last.w += rect.w;
+            return;
+        }
+        if (last.x == rect.x && last.w == rect.w && last.y + last.h == rect.y) {
+            last.h += rect.h;
+            return;
+        }
+    }
+    damage.push_back(rect);
+    if (damage.size() > SCREEN_DAMAGE_RECTS) {
+        // too fragmented, redraw the bounding box instead
+        SDL_Rect bounds = damage[0];
+        for (const SDL_Rect &r : damage) {
+            int right = std::max(bounds.x + bounds.w, r.x + r.w);
+            int bottom = std::max(bounds.y + bounds.h, r.y + r.h);
+            bounds.x = std::min(bounds.x, r.x);
+            bounds.y = std::min(bounds.y, r.y);
+            bounds.w = right - bounds.x;
+            bounds.h = bottom - bounds.y;
+        }
+        damage.assign(1, bounds);
+    }
 }
 
+// wakes the render thread, which draws the damage at most SCREEN_FRAME_RATE times a second
 void Screen::update() {
-    while (SDL_UpdateWindowSurface(window)) {
-        surface = SDL_GetWindowSurface(window);
-        std::cerr << "Screen::update(): " << SDL_GetError() << "\n";
+    render_notifier.notify_one();
+}
+
+void Screen::render_loop() {
+    struct Cell {
+        int x, y;
+        unsigned int bg, fg, c;
+    };
+    std::vector<SDL_Rect> regions;
+    std::vector<Move> pending_moves;
+    std::vector<Cell> cells;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> locker(grid_lock);
+            render_notifier.wait(locker, [this] { return stopping || resized || !damage.empty() || !moves.empty(); });
+            if (stopping) return;
+        }
+        long long wait = last_present + 1000 / SCREEN_FRAME_RATE - get_current_time();
+        if (wait > 0) std::this_thread::sleep_for(std::chrono::milliseconds(wait));
+        bool resize;
+        int w, h;
+        {
+            // copy out the damaged cells so the guest can keep writing while they are drawn
+            std::lock_guard<std::mutex> locker(grid_lock);
+            if (stopping) return;
+            resize = resized;
+            resized = false;
+            w = width;
+            h = height;
+            regions.swap(damage);
+            damage.clear();
+            pending_moves.swap(moves);
+            moves.clear();
+            cells.clear();
+            for (const SDL_Rect &r : regions) {
+                for (int y = r.y; y < r.y + r.h; y++) {
+                    for (int x = r.x, i = index(r.x, y); x < r.x + r.w; x++, i++) {
+                        cells.push_back({x, y, bg_buffer[i], fg_buffer[i], ch_buffer[i]});
+                    }
+                }
+            }
+        }
+        if (resize) resize_window(w, h);
+        bool moved = true;
+        for (const Move &move : pending_moves) {
+            SDL_Rect to = {move.from.x + move.tx, move.from.y + move.ty, move.from.w, move.from.h};
+            // later moves may read pixels an earlier one failed to bring, so those are redrawn as well
+            moved = moved && move_pixels(move);
+            if (moved) {
+                regions.push_back(to);
+                continue;
+            }
+            std::lock_guard<std::mutex> locker(grid_lock);
+            int x1 = std::max(to.x, 0), y1 = std::max(to.y, 0);
+            int x2 = std::min(to.x + to.w, width), y2 = std::min(to.y + to.h, height);
+            if (x1 < x2 && y1 < y2) mark_dirty(x1, y1, x2 - x1, y2 - y1);
+        }
+        for (const Cell &cell : cells) {
+            draw_char(cell.x, cell.y, cell.bg, cell.fg, cell.c);
+        }
+        for (SDL_Rect &r : regions) {
+            r.x *= SCREEN_FONT_WIDTH;
+            r.y *= SCREEN_FONT_HEIGHT;
+            r.w *= SCREEN_FONT_WIDTH;
+            r.h *= SCREEN_FONT_HEIGHT;
+        }
+        if (!regions.empty() && SDL_UpdateWindowSurfaceRects(window, regions.data(), regions.size())) {
+            surface = SDL_GetWindowSurface(window);
+            std::cerr << "Screen::render_loop(): " << SDL_GetError() << "\n";
+        }
+        last_present = get_current_time();
     }
 }
 
 Screen::~Screen() {
-    delete &keyboards;
+    {
+        std::lock_guard<std::mutex> locker(grid_lock);
+        stopping = true;
+    }
+    render_notifier.notify_one();
+    if (renderer.joinable()) renderer.join();
+    for (auto &[c, glyph] : glyphs) {
+        if (glyph) SDL_FreeSurface(glyph);
+    }
     SDL_DestroyWindow(window);
 }
 
@@ -744,11 +2427,7 @@ int Gpu::invoke(const string &method, lua_State *state) {
                 lua_pushboolean(state, false);
                 return 1;
             }
-            for (int cx = x; cx < x + w; cx++) {
-                for (int cy = y; cy < y + h; cy++) {
-                    screen->set_char(cx, cy, background_color, foreground_color, c);
-                }
-            }
+            screen->fill(x, y, w, h, background_color, foreground_color, c);
             screen->update();
             lua_pushboolean(state, true);
             return 1;
@@ -812,9 +2491,10 @@ int Gpu::invoke(const string &method, lua_State *state) {
             y--;
             if (x < 0 || x >= screen->width || y < 0 || y >= screen->height) api_error(state,
                                                                                        "coordinates out of bounds");
-            lua_pushstring(state, string(1, screen->ch_buffer[x][y]).c_str());
-            lua_pushinteger(state, screen->fg_buffer[x][y]);
-            lua_pushinteger(state, screen->bg_buffer[x][y]);
+            int i = screen->index(x, y);
+            lua_pushstring(state, string(1, screen->ch_buffer[i]).c_str());
+            lua_pushinteger(state, screen->fg_buffer[i]);
+            lua_pushinteger(state, screen->bg_buffer[i]);
             return 3;
         } else api_error(state, "get(): unbound GPU");
     } else if (method == "getScreen") {
@@ -882,49 +2562,7 @@ int Gpu::invoke(const string &method, lua_State *state) {
             int tx = lua_tonumber(state, 5);
             int ty = lua_tonumber(state, 6);
             //printf("copy(): %d %d %d %d %d %d\n", x1, y1, w, h, tx, ty);
-            int c = 0;
-            unsigned int **tmp_bg_buf;
-            unsigned int **tmp_fg_buf;
-            unsigned int **tmp_ch_buf;
-            if(w > 0 && h > 0) {
-                tmp_bg_buf = new unsigned int*[w];
-                tmp_fg_buf = new unsigned int*[w];
-                tmp_ch_buf = new unsigned int*[w];
-                for(int i = 0; i < w; i++) {
-                    tmp_bg_buf[i] = new unsigned int[h];
-                    tmp_fg_buf[i] = new unsigned int[h];
-                    tmp_ch_buf[i] = new unsigned int[h];
-                }
-                for (int cx = x1; cx < x1 + w; cx++) {
-                    for (int cy = y1; cy < y1 + h; cy++) {
-                        tmp_bg_buf[cx - x1][cy - y1] = screen->bg_buffer[cx][cy];
-                        tmp_fg_buf[cx - x1][cy - y1] = screen->fg_buffer[cx][cy];
-                        tmp_ch_buf[cx - x1][cy - y1] = screen->ch_buffer[cx][cy];
-                    }
-                }
-            }
-            for (int cx = x1; cx < x1 + w; cx++) {
-                for (int cy = y1; cy < y1 + h; cy++) {
-                    int dx = cx + tx;
-                    int dy = cy + ty;
-                    if (dx >= 0 && dx < screen->width && dy >= 0 && dy < screen->height &&
-                        cx >= 0 && cx < screen->width && cy >= 0 && cy < screen->height) {
-                        screen->set_char(dx, dy, tmp_bg_buf[cx - x1][cy - y1], tmp_fg_buf[cx - x1][cy - y1], tmp_ch_buf[cx - x1][cy - y1]);
-                        //screen->set_char(dx, dy, screen->bg_buffer[cx][cy], screen->fg_buffer[cx][cy], screen->ch_buffer[cx][cy]);
-                        c++;
-                    }
-                }
-            }
-            if(w > 0 && h > 0) {
-                for(int i = 0; i < w; i++) {
-                    delete[] tmp_bg_buf[i];
-                    delete[] tmp_fg_buf[i];
-                    delete[] tmp_ch_buf[i];
-                }
-                delete[] tmp_bg_buf;
-                delete[] tmp_fg_buf;
-                delete[] tmp_ch_buf;
-            }
+            int c = screen->copy(x1, y1, w, h, tx, ty);
             screen->update();
             lua_pushboolean(state, c > 0);
             return 1;
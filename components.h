@@ -2,10 +2,22 @@
 #define CODE_COMPONENTS_H
 
 #include <string>
+#include <string_view>
 #include <vector>
 #include <filesystem>
 #include <fstream>
 #include <queue>
+#include <set>
+#include <memory>
+#include <unordered_map>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <sys/types.h>
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_ttf.h>
 #include "computer.h"
@@ -40,9 +52,16 @@ public:
 
     virtual string get_type() = 0;
 
+    // closes whatever the computer left open, called when it is detached or shuts down
+    virtual void release_handles(Computer *owner);
+
     virtual ~Component();
 
     static int load_components(const string &project_dir, std::map<string, Component *> &components);
+
+    static Component *load_component(const string &project_dir, const string &type, const string &name);
+
+    static Component *load_component(const string &project_dir, const string &name);
 };
 
 static const string COMPUTER = "computer";
@@ -89,33 +108,282 @@ static const string FILESYSTEM = "filesystem";
 static const string FILESYSTEM_DATA_FOLDER = "/data/";
 static const string FILESYSTEM_READONLY_MARKER = "/readonly.txt";
 static const string FILESYSTEM_READONLY_LABEL_FILE = "/label.txt";
-static const int FILESYSTEM_MAX_BUFFER_SIZE = 4096;
+static const string FILESYSTEM_BUFFER_SIZE_FILE = "/buffer.txt";
+static const size_t FILESYSTEM_DEFAULT_BUFFER_SIZE = 4096;
+static const string FILESYSTEM_HANDLE_BUFFER_SIZE_FILE = "/handle_buffer.txt";
+static const size_t FILESYSTEM_DEFAULT_HANDLE_BUFFER_SIZE = 16384;
+static const string FILESYSTEM_CAPACITY_FILE = "/capacity.txt";
+static const string FILESYSTEM_PRELOAD_MARKER = "/preload.txt";
+static const string FILESYSTEM_HANDLE_LIMIT_FILE = "/handle_limit.txt";
+static const size_t FILESYSTEM_DEFAULT_HANDLE_LIMIT = 16;
+static const string FILESYSTEM_DURABILITY_FILE = "/durability.txt";
+static const long long FILESYSTEM_DEFAULT_SYNC_INTERVAL = 1000;
+
+static const string FILESYSTEM_TRACE_FILE = "/trace.txt";
+static const string FILESYSTEM_TRACE_LOG_FILE = "/trace.log";
+static const int FILESYSTEM_DEFAULT_TRACE_DEPTH = 2;
+static const long long FILESYSTEM_TRACE_FLUSH_INTERVAL = 1000; // milliseconds
+
+// Records filesystem calls to trace.log: method, path or handle, bytes and latency. trace.txt selects the format:
+// "jsonl", "binary" (little-endian records: int64 time_us, int64 latency_ns, uint64 bytes, int64 handle,
+// uint16 method length, uint16 path length, method, path) or "summary [depth]", which only writes totals per
+// operation and path prefix of the given depth when the filesystem is destroyed or the process exits.
+// Records are flushed at most FILESYSTEM_TRACE_FLUSH_INTERVAL apart and on exit, filesystems are never
+// destroyed when the emulator quits.
+class FilesystemTracer {
+public:
+    enum class Mode {
+        JSONL, BINARY, SUMMARY
+    };
+
+    struct Call {
+        FilesystemTracer *tracer;
+        string method;
+        string path;
+        long long handle = -1;
+        size_t bytes = 0; // written, read bytes are added by finish()
+        std::chrono::steady_clock::time_point start;
+
+        void finish(lua_State *state, int results);
+    };
+
+private:
+    struct Totals {
+        unsigned long long count = 0;
+        unsigned long long bytes = 0;
+        long long nanoseconds = 0;
+        long long max_nanoseconds = 0;
+    };
+
+    Mode mode = Mode::JSONL;
+    int depth = FILESYSTEM_DEFAULT_TRACE_DEPTH;
+    std::ofstream log;
+    std::chrono::steady_clock::time_point created = std::chrono::steady_clock::now();
+    std::unordered_map<long long, string> handle_paths;
+    std::map<std::pair<string, string>, Totals> totals; // by (operation, path prefix)
+    std::mutex lock; // calls are recorded on the VM thread, flush_all() runs on the thread that exits
+    std::chrono::steady_clock::time_point last_flush = created;
+    bool finished = false; // the summary is written once
+
+    void record(const Call &call, long long nanoseconds);
+
+    void finish();
+
+    static void flush_all();
+
+    string prefix_of(const string &path) const;
+public:
+    explicit FilesystemTracer(const string &component_folder);
+
+    Call begin(const string &method, lua_State *state);
+
+    ~FilesystemTracer();
+};
+
+// Open handles of a filesystem. Slots are reused through a free list, ids carry the slot's generation in the
+// high bits so a stale id never reaches a handle opened later in the same slot. Owns the values.
+template<class T>
+class HandleTable {
+    static const int SLOT_BITS = 16;
+    static const long long SLOT_MASK = (1LL << SLOT_BITS) - 1;
+
+    struct Slot {
+        T *value = nullptr;
+        Computer *owner = nullptr;
+        long long generation = 0;
+    };
+
+    std::vector<Slot> slots;
+    std::vector<size_t> free_slots;
+    size_t count = 0;
+
+    void free(size_t slot) {
+        delete slots[slot].value;
+        slots[slot].value = nullptr;
+        slots[slot].owner = nullptr;
+        slots[slot].generation++;
+        free_slots.push_back(slot);
+        count--;
+    }
+public:
+    size_t limit = 0; // 0 means unlimited
+
+    // returns -1 when the limit is reached, the value is not taken then
+    long long insert(T *value, Computer *owner) {
+        if ((limit && count >= limit) || (free_slots.empty() && slots.size() > SLOT_MASK)) return -1;
+        size_t slot;
+        if (free_slots.empty()) {
+            slot = slots.size();
+            slots.emplace_back();
+        } else {
+            slot = free_slots.back();
+            free_slots.pop_back();
+        }
+        slots[slot].value = value;
+        slots[slot].owner = owner;
+        count++;
+        return slots[slot].generation << SLOT_BITS | slot;
+    }
+
+    T *get(long long id) const {
+        if (id < 0 || (size_t) (id & SLOT_MASK) >= slots.size()) return nullptr;
+        const Slot &slot = slots[id & SLOT_MASK];
+        return slot.generation == id >> SLOT_BITS ? slot.value : nullptr;
+    }
+
+    // the handle passed as a Lua argument, nullptr when it is not an integer or not open
+    T *get(lua_State *state, int index) const;
+
+    bool erase(long long id) {
+        if (!get(id)) return false;
+        free(id & SLOT_MASK);
+        return true;
+    }
+
+    // closes every handle opened by the computer
+    void release(Computer *owner) {
+        for (size_t slot = 0; slot < slots.size(); slot++) {
+            if (slots[slot].value && slots[slot].owner == owner) free(slot);
+        }
+    }
+
+    ~HandleTable() {
+        for (Slot &slot : slots) {
+            delete slot.value;
+        }
+    }
+};
 
 class Filesystem : public Component {
+public:
+    // when buffered writes are forced to the disk with fdatasync
+    enum class Durability {
+        NONE, ON_CLOSE, PERIODIC, EVERY_WRITE
+    };
+
+private:
+    // state shared by every handle open on the same file
+    struct OpenFile {
+        off_t size = 0; // including writes still buffered in handles, for space accounting
+        unsigned long long generation = 0; // bumped whenever a handle writes to the file
+    };
+
     class Descriptor {
     public:
-        std::fstream *const stream;
+        const int fd;
+        const std::shared_ptr<OpenFile> file;
+        string path; // normalized, for invalidating cached metadata on writes
+        off_t position;
+        const size_t buffer_size;
+        std::vector<char> read_buffer; // read-ahead data starting at read_offset
+        off_t read_offset = 0;
+        unsigned long long read_generation = 0; // read_buffer is stale once the file's generation moves on
+        std::vector<char> write_buffer; // coalesced writes starting at write_offset
+        off_t write_offset = 0;
+        const char *mapping = nullptr; // whole file, only for read-only filesystems
+        size_t mapping_size = 0;
+        bool owns_mapping = false; // mmap'ed by map() rather than a slice of the preloaded image
+        const Durability durability;
+        const long long sync_interval; // milliseconds, for Durability::PERIODIC
+        long long last_sync;
+        bool dirty = false; // written since the last fdatasync
+
+        Descriptor(int fd, std::shared_ptr<OpenFile> file, off_t position, size_t buffer_size,
+                   Durability durability = Durability::NONE, long long sync_interval = 0);
+
+        bool map();
+
+        std::string_view read_mapped(size_t count);
+
+        ssize_t read(char *data, size_t count);
+
+        bool write(const char *data, size_t count);
 
-        explicit Descriptor(std::fstream *stream);
+        off_t seek(off_t offset, int whence);
+
+        bool flush();
+
+        bool sync();
 
         ~Descriptor();
     };
 
+public:
+    struct Metadata {
+        bool exists = false;
+        bool directory = false;
+        unsigned long long size = 0;
+        long long modified = 0;
+    };
+
 private:
-    std::vector<Descriptor *> descriptors;
-    std::queue<int> free_descriptors;
+    HandleTable<Descriptor> descriptors;
+    std::map<std::pair<dev_t, ino_t>, std::weak_ptr<OpenFile>> open_files; // by inode, so renames keep sharing
+
+    std::shared_ptr<OpenFile> share_file(int fd, bool truncated);
+    std::unordered_map<string, Metadata> metadata_cache; // keyed by normalized path
+    int inotify_fd = -1;
+    std::unordered_map<int, string> watched_directories; // inotify watch -> normalized path
+    std::unordered_map<string, int> directory_watches;
+    std::unordered_map<string, std::vector<string>> listing_cache; // sorted entries, directories end with '/'
+    Metadata uncached_metadata; // returned for paths whose directory could not be watched
+    std::vector<string> uncached_listing;
+
+    bool watch_directory(const string &path);
+
+    void invalidate_metadata(const string &path, bool recursive);
+
+    void invalidate_path(const string &path, bool recursive);
+
+    void sync_metadata_cache();
+
+    std::vector<char> preload_image; // every file of a preloaded read-only tree, back to back
+    std::unordered_map<string, std::pair<size_t, size_t>> preload_index; // path -> offset, size in the image
+    std::atomic<bool> preloaded = false;
+    std::thread preload_thread;
+
+    void preload();
+
+    string data_directory; // resolved once, ends with '/'
+    string resolved_path; // reused by resolve() between calls
+
+    const string &resolve(std::string_view path);
+protected:
+    long long used_space = -1; // scanned on first use, then maintained incrementally
+
+    unsigned long long tree_size(const string &path);
+
+    static unsigned long long directory_size(const string &directory);
+
+    static std::vector<string> scan_directory(const string &directory);
+
+    // position of an in-memory handle after seek(handle, whence, offset), never before the start
+    static long long seek_position(lua_State *state, long long position, long long size);
 public:
     const string project_dir;
+    size_t max_buffer_size = FILESYSTEM_DEFAULT_BUFFER_SIZE;
+    size_t handle_buffer_size = FILESYSTEM_DEFAULT_HANDLE_BUFFER_SIZE;
+    FilesystemTracer *tracer = nullptr; // only when trace.txt exists
+    size_t handle_limit = FILESYSTEM_DEFAULT_HANDLE_LIMIT; // open handles, 0 means unlimited
+    bool deduplicated = false; // files may be hard links into the project's blob store
+    Durability durability = Durability::NONE;
+    long long sync_interval = FILESYSTEM_DEFAULT_SYNC_INTERVAL;
+    unsigned long long capacity = 0; // 0 means limited only by the host disk
 
     Filesystem(const string &project_dir, const string &name);
 
     int invoke(const string &method, lua_State *state) override;
 
+    // the methods themselves, invoke() wraps them with tracing
+    virtual int dispatch(const string &method, lua_State *state);
+
     std::vector<std::pair<string, bool>> get_methods() override;
 
     string get_type() override;
 
-    string get_data_directory();
+    void release_handles(Computer *owner) override;
+
+    const string &get_data_directory();
 
     bool is_readonly();
 
@@ -125,15 +393,195 @@ public:
 
     unsigned long long space_used();
 
+    unsigned long long space_total();
+
+    const Metadata &get_metadata(const string &path);
+
+    const std::vector<string> *get_listing(const string &path);
+
+    static string normalize_path(const string &path);
+
+    static void normalize_path(std::string_view path, string &result);
+
+    static string parent_path(const string &path);
+
     ~Filesystem();
 };
 
+static const size_t TMPFS_DEFAULT_CAPACITY = 64 * 1024;
+
+class TmpFilesystem : public Filesystem {
+    struct Node {
+        bool directory = false;
+        std::vector<char> data;
+        std::set<string> children;
+        long long modified = 0;
+        unsigned long long *used = nullptr; // space is given back when the last path or handle drops the node
+
+        ~Node() {
+            if (used) *used -= data.size();
+        }
+    };
+
+    struct Handle {
+        std::shared_ptr<Node> node;
+        size_t position = 0;
+        bool writable = false;
+    };
+
+private:
+    unsigned long long used = 0; // declared first, nodes update it when they are destroyed
+    std::unordered_map<string, std::shared_ptr<Node>> nodes;
+    HandleTable<Handle> handles;
+    string label;
+
+    std::shared_ptr<Node> find(const string &path);
+
+    std::shared_ptr<Node> create(const string &path, bool directory);
+
+    size_t remove_node(const string &path);
+public:
+    TmpFilesystem(const string &project_dir, const string &name);
+
+    int dispatch(const string &method, lua_State *state) override;
+
+    void release_handles(Computer *owner) override;
+
+    ~TmpFilesystem();
+};
+
+static const string FILESYSTEM_LOWER_FILE = "/lower.txt";
+static const string FILESYSTEM_WHITEOUT_PREFIX = ".wh.";
+static const string FILESYSTEM_OPAQUE_MARKER = ".wh..wh..opq";
+
+// Copy-on-write filesystem: data folder is the upper layer, lower.txt names a filesystem shared as the read-only layer
+class OverlayFilesystem : public Filesystem {
+    struct Handle {
+        Filesystem *layer;
+        long long handle;
+    };
+
+private:
+    Filesystem *lower = nullptr;
+    HandleTable<Handle> handles;
+
+    int invoke_layer(Filesystem *layer, const string &method, lua_State *state);
+
+    bool lower_visible(const string &path);
+
+    Filesystem *layer_of(const string &path);
+
+    std::vector<string> merged_listing(const string &path);
+
+    bool make_upper_directory(const string &path);
+
+    bool copy_up(const string &src, const string &dst);
+
+    bool remove_path(const string &path);
+
+    bool has_directory(const string &path);
+
+    bool rename_path(const string &src, const string &dst);
+public:
+    OverlayFilesystem(const string &project_dir, const string &name);
+
+    int dispatch(const string &method, lua_State *state) override;
+
+    void release_handles(Computer *owner) override;
+
+    static string whiteout_of(const string &path);
+
+    ~OverlayFilesystem();
+};
+
+static const string FILESYSTEM_IMAGE_FILE = "/image.bin";
+static const char FILESYSTEM_IMAGE_MAGIC[8] = {'C', 'O', 'D', 'E', 'P', 'A', 'C', 'K'};
+static const uint32_t FILESYSTEM_IMAGE_VERSION = 1;
+
+// Read-only filesystem stored in a single image file: header, entry index sorted by (parent, name), paths, file data
+class PackedFilesystem : public Filesystem {
+public:
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t entry_count;
+    };
+
+    struct Entry {
+        uint64_t path_offset;
+        uint32_t path_length;
+        uint32_t parent_length;
+        uint64_t data_offset;
+        uint64_t size;
+        int64_t modified;
+        uint32_t directory;
+        uint32_t reserved;
+    };
+
+private:
+    struct Handle {
+        const Entry *entry;
+        uint64_t position = 0;
+    };
+
+    const char *image = nullptr;
+    size_t image_size = 0;
+    const Entry *entries = nullptr;
+    size_t entry_count = 0;
+    unsigned long long files_size = 0;
+    HandleTable<Handle> handles;
+
+    std::string_view path_of(const Entry &entry) const;
+
+    std::string_view parent_of(const Entry &entry) const;
+
+    std::string_view name_of(const Entry &entry) const;
+
+    const Entry *find(const string &path) const;
+
+    std::pair<const Entry *, const Entry *> children(const string &path) const;
+
+    static bool valid_entry(const Entry &entry, uint64_t image_size);
+public:
+    PackedFilesystem(const string &project_dir, const string &name);
+
+    int dispatch(const string &method, lua_State *state) override;
+
+    void release_handles(Computer *owner) override;
+
+    static bool pack(const string &data_directory, const string &image_file);
+
+    static bool unpack(const string &image_file, const string &data_directory);
+
+    ~PackedFilesystem();
+};
+
+static const string STORE_FOLDER = "store/";
+static const string FILESYSTEM_DEDUP_MARKER = "/dedup.txt";
+
+// Content-addressed file blobs of a project, deduplicated filesystems share them through hard links
+class BlobStore {
+private:
+    static bool same_content(const string &file, const string &other);
+public:
+    static string hash_file(const string &file);
+
+    static bool deduplicate(const string &project_dir, const string &name);
+
+    static int collect(const string &project_dir);
+
+    static bool unshare(const string &file, bool truncate);
+};
+
 
 static const string SCREEN = "screen";
 static const string SCREEN_CONFIG_FILE = "/config.txt";
 static const string SCREEN_KEYBOARDS_FILE = "/keyboards.txt";
 static const string SCREEN_FONT_FILE = "font.ttf";
 static const int SCREEN_FONT_WIDTH = 8, SCREEN_FONT_HEIGHT = 16;
+static const int SCREEN_FRAME_RATE = 60;
+static const int SCREEN_DAMAGE_RECTS = 64;
+static const int SCREEN_MOVES = 16;
 
 class Screen : public Component {
 public:
@@ -146,9 +594,28 @@ public:
     std::vector<string> keyboards;
     SDL_Window *const window;
     SDL_Surface *surface;
-    unsigned int **ch_buffer = nullptr;
-    unsigned int **fg_buffer = nullptr;
-    unsigned int **bg_buffer = nullptr;
+    // cell attributes, one row-major plane each, see index()
+    std::vector<unsigned int> ch_buffer;
+    std::vector<unsigned int> fg_buffer;
+    std::vector<unsigned int> bg_buffer;
+    // guards the cell buffers, damage and resized, which the render thread reads
+    std::mutex grid_lock;
+    std::condition_variable render_notifier;
+    // a region of the window to shift by (tx, ty) cells, replayed before the damage is drawn
+    struct Move {
+        SDL_Rect from;
+        int tx, ty;
+    };
+
+    // cells changed since the render thread last drew, in cells
+    std::vector<SDL_Rect> damage;
+    std::vector<Move> moves;
+    bool resized = false;
+    bool stopping = false;
+    // the following are touched by the render thread only
+    std::unordered_map<unsigned int, SDL_Surface *> glyphs;
+    long long last_present = 0;
+    std::thread renderer;
 
     Screen(const string &project_dir, const string &name);
 
@@ -160,13 +627,30 @@ public:
 
     void update_size(int w, int h);
 
+    int index(int x, int y) const { return y * width + x; }
+
     void set_char(int x, int y, unsigned int bg, unsigned int fg, unsigned int c);
 
-    void draw_char(int x, int y, unsigned int bg, unsigned int fg, unsigned int c);
+    void fill(int x, int y, int w, int h, unsigned int bg, unsigned int fg, unsigned int c);
+
+    int copy(int x, int y, int w, int h, int tx, int ty);
+
+    void mark_dirty(int x, int y, int w, int h);
 
     void update();
 
     ~Screen();
+
+private:
+    void render_loop();
+
+    void resize_window(int w, int h);
+
+    bool move_pixels(const Move &move);
+
+    SDL_Surface *get_glyph(unsigned int c);
+
+    void draw_char(int x, int y, unsigned int bg, unsigned int fg, unsigned int c);
 };
 
 static const string KEYBOARD = "keyboard";
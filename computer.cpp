@@ -1,49 +1,153 @@
 #include "computer.h"
 #include "components.h"
 #include <chrono>
+#include <algorithm>
+#include <iostream>
 
 
 Computer::Computer(string &project_dir, string &name,
                    std::map<string, Component *> &all_components) :
         address(get_computer_address(project_dir, name)),
         name(name), start_time(get_current_time()), memory(get_computer_memory(project_dir, name)) {
+    std::ifstream in2(project_dir + COMPUTERS_FOLDER + name + COMPUTER_TEMP_FS_FILE);
+    string tmp_fs_name;
+    in2 >> tmp_fs_name;
+    if (!tmp_fs_name.empty()) {
+        tmp_fs = new TmpFilesystem(project_dir, tmp_fs_name);
+        tmp_fs->computer = this;
+        components.push_back(tmp_fs);
+        index_component(tmp_fs);
+    }
     std::ifstream in(project_dir + COMPUTERS_FOLDER + name + COMPUTER_COMPONENTS_FILE);
     string component_name;
     while (in >> component_name) {
+        if (component_name == tmp_fs_name) continue; // replaced by the in-memory tmpfs
         Component *component = all_components[component_name];
         components.push_back(component);
+        index_component(component);
         component->computer = this;
     }
-    components.push_back(new ComputerComponent(this));
-    std::ifstream in2(project_dir + COMPUTERS_FOLDER + name + COMPUTER_TEMP_FS_FILE);
-    string tmp_fs_name;
-    in2 >> tmp_fs_name;
-    tmp_fs = dynamic_cast<Filesystem *>(all_components[tmp_fs_name]);
+    auto *computer_component = new ComputerComponent(this);
+    components.push_back(computer_component);
+    index_component(computer_component);
+}
+
+void Computer::index_component(Component *component) {
+    address_index[component->address] = component;
+    type_index[component->get_type()].push_back(component);
+}
+
+void Computer::unindex_component(Component *component) {
+    address_index.erase(component->address);
+    auto &same_type = type_index[component->get_type()];
+    same_type.erase(std::remove(same_type.begin(), same_type.end(), component), same_type.end());
 }
 
 int Computer::get_components(std::vector<Component *> *v = nullptr) {
-    int c = 0;
-    for (auto component : components) {
-        if (v) v->push_back(component);
-        c++;
-    }
-    return c;
+    std::unique_lock<std::mutex> locker(components_lock);
+    if (v) v->insert(v->end(), components.begin(), components.end());
+    return components.size();
 }
 
 Component *Computer::get_component(const string &component_address) {
-    for (Component *component : components) {
-        if (component->address == component_address) return component;
-    }
-    return nullptr;
+    std::unique_lock<std::mutex> locker(components_lock);
+    auto it = address_index.find(component_address);
+    return it == address_index.end() ? nullptr : it->second;
 }
 
 Component *Computer::get_component_by_name(const string &component_name) {
+    std::unique_lock<std::mutex> locker(components_lock);
     for (Component *component : components) {
         if (component->name == component_name) return component;
     }
     return nullptr;
 }
 
+int Computer::get_components_by_type(const string &type, std::vector<Component *> *v = nullptr) {
+    std::unique_lock<std::mutex> locker(components_lock);
+    auto it = type_index.find(type);
+    if (it == type_index.end()) return 0;
+    if (v) v->insert(v->end(), it->second.begin(), it->second.end());
+    return it->second.size();
+}
+
+bool Computer::attach_component(Component *component) {
+    {
+        std::unique_lock<std::mutex> locker(components_lock);
+        if (component->computer || address_index.count(component->address)) return false;
+        components.push_back(component);
+        index_component(component);
+        component->computer = this;
+    }
+    push_signal("\"component_added\", \"" + component->address + "\", \"" + component->get_type() + "\"");
+    return true;
+}
+
+bool Computer::detach_component(Component *component) {
+    if (component->get_type() == COMPUTER || component == tmp_fs) return false;
+    {
+        std::unique_lock<std::mutex> locker(components_lock);
+        auto it = std::find(components.begin(), components.end(), component);
+        if (it == components.end()) return false;
+        components.erase(it);
+        unindex_component(component);
+        component->computer = nullptr;
+        if (component->get_type() == SCREEN) {
+            auto gpus = type_index.find(GPU);
+            if (gpus != type_index.end()) {
+                for (Component *gpu : gpus->second) {
+                    auto *bound = dynamic_cast<Gpu *>(gpu);
+                    if (bound->screen == component) bound->screen = nullptr;
+                }
+            }
+        }
+    }
+    component->release_handles(this);
+    push_signal("\"component_removed\", \"" + component->address + "\", \"" + component->get_type() + "\"");
+    return true;
+}
+
+void Computer::request_attach(Component *component) {
+    std::unique_lock<std::mutex> locker(queue_lock);
+    component_changes.push_back({component, true});
+    queue_notifier.notify_all();
+}
+
+void Computer::request_detach(Component *component) {
+    std::unique_lock<std::mutex> locker(queue_lock);
+    component_changes.push_back({component, false});
+    queue_notifier.notify_all();
+}
+
+// runs on the VM thread between resumes, so no component is inside invoke() while it is attached or detached
+void Computer::apply_component_changes() {
+    std::vector<std::pair<Component *, bool>> changes;
+    {
+        std::unique_lock<std::mutex> locker(queue_lock);
+        changes.swap(component_changes);
+    }
+    for (auto [component, attach] : changes) {
+        if (attach && !attach_component(component)) {
+            std::cerr << "attach: component is already attached: " << component->name << std::endl;
+        } else if (!attach && !detach_component(component)) {
+            std::cerr << "detach: cannot detach component: " << component->name << std::endl;
+        }
+    }
+}
+
+void Computer::push_signal(const string &signal) {
+    std::unique_lock<std::mutex> locker(queue_lock);
+    signal_queue.push(signal);
+    queue_notifier.notify_all();
+}
+
+
+Computer::~Computer() {
+    for (Component *component : components) {
+        if (component == tmp_fs || component->get_type() == COMPUTER) delete component;
+    }
+}
+
 
 string get_computer_address(const string &project_dir, const string &computer_name) {
     std::ifstream in(project_dir + COMPUTERS_FOLDER + computer_name + COMPUTER_ADDRESS_FILE);
@@ -3,6 +3,8 @@
 
 #include <string>
 #include <vector>
+#include <map>
+#include <mutex>
 #include <condition_variable>
 #include "components.h"
 
@@ -31,6 +33,13 @@ private:
     friend Session;
     Session *session = nullptr;
     std::vector<Component *> components;
+    std::map<string, Component *> address_index;
+    std::map<string, std::vector<Component *>> type_index;
+    std::mutex components_lock;
+
+    void index_component(Component *component);
+
+    void unindex_component(Component *component);
 public:
     const string address;
     const string name;
@@ -40,7 +49,9 @@ public:
     std::queue<string> signal_queue;
     std::mutex queue_lock;
     std::condition_variable queue_notifier;
-    Filesystem *tmp_fs;
+    // attach (true) and detach (false) requests from other threads, applied by the VM thread, guarded by queue_lock
+    std::vector<std::pair<Component *, bool>> component_changes;
+    Filesystem *tmp_fs = nullptr;
 
     explicit Computer(string &project_dir, string &name, std::map<string, Component *> &all_components);
 
@@ -49,6 +60,22 @@ public:
     Component *get_component(const string &component_address);
 
     Component *get_component_by_name(const string &component_name);
+
+    int get_components_by_type(const string &type, std::vector<Component *> *v);
+
+    bool attach_component(Component *component);
+
+    bool detach_component(Component *component);
+
+    void request_attach(Component *component);
+
+    void request_detach(Component *component);
+
+    void apply_component_changes();
+
+    void push_signal(const string &signal);
+
+    ~Computer();
 };
 
 #endif //CODE_COMPUTER_H
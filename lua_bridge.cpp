@@ -117,7 +117,8 @@ public:
         lua_pop(state, argc);
 
         std::vector<Component *> components;
-        computer->get_components(&components);
+        if (exact && !filter.empty()) computer->get_components_by_type(filter, &components);
+        else computer->get_components(&components);
 
         lua_createtable(state, 0, components.size());
         int table = lua_gettop(state);
@@ -194,13 +195,17 @@ public:
         int table = lua_gettop(state);
         for (auto[name, direct] : methods) {
             lua_pushstring(state, name.c_str());
-            lua_pushlightuserdata(state, component);
+            lua_pushlightuserdata(state, computer);
+            lua_pushstring(state, component->address.c_str());
             lua_pushstring(state, name.c_str());
+            // looked up on every call, a proxy outlives the component being detached
             lua_pushcclosure(state, [](lua_State *state) -> int {
-                auto *component = static_cast<Component *>(lua_touserdata(state, lua_upvalueindex(1)));
-                string method = lua_tostring(state, lua_upvalueindex(2));
+                auto *computer = get_computer_upvalue(state, 1);
+                Component *component = computer->get_component(lua_tostring(state, lua_upvalueindex(2)));
+                if (!component) api_error(state, "no such component");
+                string method = lua_tostring(state, lua_upvalueindex(3));
                 return component->invoke(method, state);
-            }, 2);
+            }, 3);
             lua_settable(state, table);
         }
         lua_pushliteral(state, "address");
@@ -251,6 +256,7 @@ public:
 
     static int tmp_address(lua_State *state) {
         auto *computer = get_computer_upvalue(state, 1);
+        if (!computer->tmp_fs) return 0;
         lua_pushstring(state, computer->tmp_fs->address.c_str());
         return 1;
     }
@@ -708,10 +714,17 @@ static void emulate_computer(Computer *computer, std::istream *stream) {
         if (signal_yield) {
             std::unique_lock<std::mutex> locker(computer->queue_lock);
             long long time = signal_deadline - get_current_time();
-            if (signal_deadline != 0) computer->queue_notifier.wait_for(locker, std::chrono::milliseconds(time));
-            else computer->queue_notifier.wait(locker);
+            auto ready = [computer] { return !computer->signal_queue.empty() || !computer->component_changes.empty(); };
+            if (signal_deadline != 0) computer->queue_notifier.wait_for(locker, std::chrono::milliseconds(time), ready);
+            else computer->queue_notifier.wait(locker, ready);
             //printf("continue\n");
         }
+        computer->apply_component_changes();
+    }
+    std::vector<Component *> components;
+    computer->get_components(&components);
+    for (Component *component : components) {
+        component->release_handles(computer);
     }
     if (status == LUA_OK) {
         std::cerr << "Computer halted\n";
@@ -728,11 +741,9 @@ static void emulate_computer(Computer *computer, std::istream *stream) {
 
 static std::thread *boot_computer(Computer *computer) {
     std::vector<Component *> components;
-    computer->get_components(&components);
+    computer->get_components_by_type(EEPROM, &components);
     Eeprom *eeprom = nullptr;
-    for (Component *component : components) {
-        if (component->get_type() == EEPROM) eeprom = dynamic_cast<Eeprom *>(component);
-    }
+    if (!components.empty()) eeprom = dynamic_cast<Eeprom *>(components.back());
     auto stream = new std::istringstream(eeprom->get_primary());
     auto *thread = new std::thread(emulate_computer, computer, stream);
     return thread;
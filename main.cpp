@@ -9,6 +9,8 @@
 #include <map>
 #include <vector>
 #include <list>
+#include <atomic>
+#include <poll.h>
 
 #include "components.cpp"
 #include "computer.cpp"
@@ -21,6 +23,7 @@ using std::string;
 
 
 static const string DEFAULT_USER = "user";
+static const int CONSOLE_POLL_INTERVAL = 100; // milliseconds
 
 static void put_key_codes(std::map<SDL_Scancode, int> &key_codes) {
     key_codes[SDL_SCANCODE_1] = 0x02;
@@ -101,8 +104,6 @@ static void sdl_poll_event_thread(Computer *computer) {
 
     bool ctrl = false;
 
-    std::vector<Component *> components;
-    computer->get_components(&components);
     while (true) {
         SDL_Event event;
         bool ok = SDL_WaitEvent(&event);
@@ -110,6 +111,8 @@ static void sdl_poll_event_thread(Computer *computer) {
             std::cerr << "Failed to wait for SDL event: " << SDL_GetError() << std::endl;
             return;
         }
+        std::vector<Component *> components;
+        computer->get_components_by_type(SCREEN, &components);
         if(event.type == SDL_QUIT) {
             exit(0);
         } else if(event.type == SDL_KEYDOWN) {
@@ -145,9 +148,7 @@ static void sdl_poll_event_thread(Computer *computer) {
                         signal += ", \"";
                         signal += DEFAULT_USER;
                         signal += "\"";
-                        std::unique_lock<std::mutex> locker(computer->queue_lock);
-                        computer->signal_queue.push(signal);
-                        computer->queue_notifier.notify_all();
+                        computer->push_signal(signal);
                         break;
                     }
                 }
@@ -173,9 +174,7 @@ static void sdl_poll_event_thread(Computer *computer) {
                         signal += ", \"";
                         signal += DEFAULT_USER;
                         signal += "\"";
-                        std::unique_lock<std::mutex> locker(computer->queue_lock);
-                        computer->signal_queue.push(signal);
-                        computer->queue_notifier.notify_all();
+                        computer->push_signal(signal);
                         break;
                     }
                 }
@@ -185,9 +184,52 @@ static void sdl_poll_event_thread(Computer *computer) {
 }
 
 
+static void run_console_command(const string &line, const string &project_directory, Computer *computer,
+                                std::map<string, Component *> *components) {
+    std::istringstream tokens(line);
+    string cmd, component_name;
+    if (!(tokens >> cmd >> component_name)) return;
+    if (cmd == "attach") {
+        Component *&component = (*components)[component_name];
+        if (!component) component = Component::load_component(project_directory, component_name);
+        if (!component) {
+            components->erase(component_name);
+            std::cerr << "attach: no such component: " << component_name << std::endl;
+        } else {
+            computer->request_attach(component);
+        }
+    } else if (cmd == "detach") {
+        Component *component = computer->get_component_by_name(component_name);
+        if (!component) std::cerr << "detach: cannot detach component: " << component_name << std::endl;
+        else computer->request_detach(component);
+    } else {
+        std::cerr << "unknown command: " << cmd << std::endl;
+    }
+}
+
+// reads commands from stdin until it is closed or stopping is set, polling so that it can be joined
+static void console_thread(string project_directory, Computer *computer, std::map<string, Component *> *components,
+                           std::atomic<bool> *stopping) {
+    string pending;
+    char buffer[256];
+    while (!*stopping) {
+        pollfd input = {STDIN_FILENO, POLLIN, 0};
+        int ready = poll(&input, 1, CONSOLE_POLL_INTERVAL);
+        if (ready < 0 && errno != EINTR) return;
+        if (ready <= 0) continue;
+        ssize_t n = read(STDIN_FILENO, buffer, sizeof(buffer));
+        if (n <= 0) return;
+        pending.append(buffer, n);
+        size_t end;
+        while ((end = pending.find('\n')) != string::npos) {
+            run_console_command(pending.substr(0, end), project_directory, computer, components);
+            pending.erase(0, end + 1);
+        }
+    }
+}
+
+
 void exec_cmd(string &project_directory, std::list<string> &cmd_tokens) {
-    std::map<string, Component *> components;
-    Component::load_components(project_directory, components);
     if (cmd_tokens.empty()) return;
     string cmd;
     cmd = cmd_tokens.front();
@@ -197,12 +239,18 @@ void exec_cmd(string &project_directory, std::list<string> &cmd_tokens) {
             printf("Not enough arguments\n");
             return;
         }
+        std::map<string, Component *> components;
+        Component::load_components(project_directory, components);
         string computer_name = cmd_tokens.front();
         cmd_tokens.pop_front();
         auto *computer = new Computer(project_directory, computer_name, components);
         std::thread event_thread(sdl_poll_event_thread, computer);
+        std::atomic<bool> console_stopping = false;
+        std::thread console(console_thread, project_directory, computer, &components, &console_stopping);
         std::thread *thread = boot_computer(computer);
         thread->join();
+        console_stopping = true;
+        console.join(); // before the computer and the components it uses are deleted
 
         SDL_Event quit_event;
         quit_event.type = SDL_QUIT; // signalling thread to terminate
@@ -213,6 +261,40 @@ void exec_cmd(string &project_directory, std::list<string> &cmd_tokens) {
         delete computer;
         for(auto [name, component] : components) delete component;
         components.clear();
+    } else if(cmd == "pack" || cmd == "unpack") {
+        if (cmd_tokens.empty()) {
+            printf("Not enough arguments\n");
+            return;
+        }
+        string folder = get_component_folder(project_directory, FILESYSTEM, cmd_tokens.front());
+        string data_directory = folder + FILESYSTEM_DATA_FOLDER;
+        string image_file = folder + FILESYSTEM_IMAGE_FILE;
+        std::error_code err;
+        if (cmd == "pack") {
+            if (!std::filesystem::is_directory(data_directory)) {
+                printf("No data folder to pack\n");
+                return;
+            }
+            // the data folder is kept, the image takes precedence over it while it exists
+            if (!PackedFilesystem::pack(data_directory, image_file)) printf("Failed to pack %s\n", data_directory.c_str());
+        } else {
+            if (!std::filesystem::is_regular_file(image_file) || std::filesystem::exists(data_directory)) {
+                printf("No image to unpack or data folder already exists\n");
+                return;
+            }
+            if (PackedFilesystem::unpack(image_file, data_directory)) std::filesystem::remove(image_file, err);
+        }
+    } else if (cmd == "dedup") {
+        if (cmd_tokens.empty()) {
+            printf("Not enough arguments\n");
+            return;
+        }
+        for (const string &name : cmd_tokens) {
+            if (!BlobStore::deduplicate(project_directory, name)) printf("Failed to deduplicate %s\n", name.c_str());
+        }
+        printf("Removed %d unused blobs\n", BlobStore::collect(project_directory));
+    } else {
+        printf("Unknown command: %s\n", cmd.c_str());
     }
 }
 